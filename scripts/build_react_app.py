@@ -28,4 +28,31 @@ def createReactAssets( source, target, env ):
         print(f"Error building react application in ./{react_proj_dir}")
         return    
     os.chdir('..')
+    checkAssetsFit(data_dir_path)
+
+# The LittleFS partition shrank to make room for the second app slot, so stop
+# here with a clear message rather than fail on the device at uploadfs time
+def checkAssetsFit( data_dir_path ):
+    partition_size = None
+    with open(os.path.join(env.get('PROJECT_DIR'), 'partitions.csv')) as partitions:
+        for line in partitions:
+            fields = [field.strip() for field in line.split(',')]
+            if len(fields) >= 5 and fields[0] == 'spiffs':
+                partition_size = int(fields[4], 0)
+    if partition_size is None:
+        return
+    # Whole 4 KB blocks per file plus one for its metadata, and two for the root
+    block = 4096
+    blocks = 2
+    for root, dirs, files in os.walk(data_dir_path):
+        blocks += len(dirs)
+        for name in files:
+            size = os.path.getsize(os.path.join(root, name))
+            blocks += (size + block - 1) // block + 1
+    used = blocks * block
+    print(f'\nWeb assets: about {used} of {partition_size} bytes of LittleFS, {partition_size - used} to spare')
+    if used > partition_size:
+        print('Error: the web assets do not fit the LittleFS partition in partitions.csv')
+        env.Exit(1)
+
 env.AddPreAction( '$BUILD_DIR/littlefs.bin', createReactAssets )
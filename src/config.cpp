@@ -5,15 +5,19 @@ AsyncWebServer server(80);
 AsyncEventSource countEvents(EVENT_SOURCE_COUNT);
 AsyncEventSource runningAverageEvents(EVENT_SOURCE_RUNNING_AVERAGE);
 AsyncEventSource timeEvents(EVENT_SOURCE_TIME);
+AsyncEventSource historyEvents(EVENT_SOURCE_HISTORY);
+AsyncWebSocket telemetrySocket(WEBSOCKET_TELEMETRY);
 LiquidCrystal_I2C LCD(0x27, 16, 2);
 Preferences preferences;
 RTC_DS3231 rtc;
 
-String STA_SSID = "your_ssid";
-String STA_PASSWORD = "your_password";
-String AP_SSID = "Drum Counter";
-String AP_PASSWORD = "";
-int Log_Interval = 60; // in seconds
+DeviceConfig config;
+
+volatile StaState _staState = STA_IDLE;
+volatile uint8_t _staLastReason = 0;
+uint _staAttempts = 0;
+ulong _staAttemptTime = 0;
+ulong _staRetryDelay = staRetryMinInterval;
 ulong _lastLogTime = 0;
 uint _lastLogCount = 0;
 
@@ -30,18 +34,19 @@ unsigned long lastDebounceTimePin2 = 0;
 
 DateTime _currentDate;
 DateTime _lastDate;
+uint32_t _currentUnix = 0;
+
+uint32_t _clockBaseUnix = 0;
+ulong _clockBaseMillis = 0;
+ulong _lastClockSync = 0;
 
 ulong _lastTimeCheck = 0;
 uint _lastCountCheck = 0;
 double _runningAverageCPM = 0.0;
 double _runningAverageCPH = 0.0;
 
-// Schedule variables - Default to schedule disabled, 07:00-16:00 if enabled
-bool scheduleEnabled = false;
-int startHour = 7;
-int startMinute = 0;
-int stopHour = 16;
-int stopMinute = 0;
+bool _scheduleActive = true;
+uint32_t _scheduleNextTransition = 0; // 0 forces a compile on the next check
 
 void redirectToIndex(AsyncWebServerRequest *request)
 {
@@ -52,14 +57,20 @@ void WiFi_Init()
 {
   WiFi.disconnect();
   WiFi.mode(WIFI_OFF);
-  WiFi.mode(WIFI_AP);
-  if (AP_PASSWORD == "")
+  WiFi.onEvent(WiFi_Event);
+  WiFi.setHostname(DEFAULT_HOSTNAME);
+  // Keep the soft-AP for commissioning and join the plant LAN at the same time.
+  // Note the AP follows the station's channel once it associates.
+  WiFi.mode(WIFI_AP_STA);
+  // Reconnection is driven by WiFi_Loop() so the backoff is ours, not the driver's
+  WiFi.setAutoReconnect(false);
+  if (config.apPassword[0] == '\0')
   {
-    WiFi.softAP(AP_SSID.c_str());
+    WiFi.softAP(config.apSsid);
   }
   else
   {
-    WiFi.softAP(AP_SSID.c_str(), AP_PASSWORD.c_str());
+    WiFi.softAP(config.apSsid, config.apPassword);
   }
   WiFi.softAPConfig(apIP, apIP, gateway);
 
@@ -67,37 +78,147 @@ void WiFi_Init()
   Serial.println("\nWiFi AP is now running\nIP address: ");
   Serial.println(WiFi.softAPIP());
 #endif
-}
 
+  WiFi_Connect();
+}
+// MARK: WiFi_Connect
+// Starts a station connection attempt and returns immediately, the outcome
+// arrives through WiFi_Event().
 void WiFi_Connect()
 {
-  int _attempts = 0;
+  if (config.staSsid[0] == '\0')
+  {
+    _staState = STA_IDLE;
 #ifdef DEBUG
-  Serial.println("Connecting to WiFi...");
+    Serial.println("No station SSID configured, running AP only");
 #endif
-  WiFi.begin(STA_SSID.c_str(), STA_PASSWORD.c_str());
-  while (WiFi.status() != WL_CONNECTED && _attempts < 10)
-  {
-    delay(500);
+    return;
+  }
 #ifdef DEBUG
-    Serial.print(".");
+  Serial.printf("Connecting to WiFi \"%s\" (attempt %u)...\n", config.staSsid, _staAttempts + 1);
 #endif
+  _staAttempts++;
+  _staAttemptTime = millis();
+  _staState = STA_CONNECTING;
+  WiFi.begin(config.staSsid, config.staPassword);
+}
+// MARK: WiFi_Reconnect
+static volatile bool _staReconnectRequested = false;
+
+// Drops the current link so new credentials are picked up straight away.
+// Called from the web server task, WiFi_Loop() does the work.
+void WiFi_Reconnect()
+{
+  _staReconnectRequested = true;
+}
+// MARK: WiFi_Event
+// Runs in the WiFi event task, so only touch the volatile state here and let
+// WiFi_Loop() do the work.
+void WiFi_Event(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+  switch (event)
+  {
+  case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+    _staState = STA_CONNECTED;
+    break;
+  case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    _staLastReason = info.wifi_sta_disconnected.reason;
+    if (_staState != STA_IDLE)
+    {
+      _staState = STA_WAITING_RETRY;
+    }
+    break;
+  default:
+    break;
   }
+}
+// MARK: WiFi_Loop
+void WiFi_Loop()
+{
+  static StaState lastState = STA_IDLE;
+  unsigned long currentTime = millis();
+  if (_staReconnectRequested)
+  {
+    _staReconnectRequested = false;
+    _staState = STA_IDLE;
+    WiFi.disconnect();
+    _staAttempts = 0;
+    _staRetryDelay = staRetryMinInterval;
+    _staAttemptTime = currentTime;
+    // Connect after the retry delay, so the DISCONNECTED event of the link
+    // just dropped lands on WAITING_RETRY instead of the new attempt
+    _staState = config.staSsid[0] == '\0' ? STA_IDLE : STA_WAITING_RETRY;
+  }
+  StaState state = _staState;
 
-  if (WiFi.status() == WL_CONNECTED)
+  if (state != lastState)
   {
+    if (state == STA_CONNECTED)
+    {
+      _staAttempts = 0;
+      _staRetryDelay = staRetryMinInterval;
+      MDNS.end();
+      if (MDNS.begin(DEFAULT_HOSTNAME))
+      {
+        MDNS.addService("http", "tcp", 80);
+      }
 #ifdef DEBUG
-    Serial.println("\nConnected to WiFi");
-    Serial.print("IP address: ");
-    Serial.println(WiFi.localIP());
+      Serial.print("Connected to WiFi, IP address: ");
+      Serial.println(WiFi.localIP());
 #endif
-  }
-  else
-  {
+    }
+    else if (state == STA_WAITING_RETRY)
+    {
+      // The retry delay is measured from the moment the link dropped
+      _staAttemptTime = currentTime;
 #ifdef DEBUG
-    Serial.println("\nFailed to connect to WiFi");
+      Serial.printf("WiFi disconnected (reason %u), retrying in %lu ms\n", _staLastReason, _staRetryDelay);
 #endif
+    }
+    lastState = state;
+  }
+
+  if (state == STA_CONNECTING && currentTime - _staAttemptTime > staConnectTimeout)
+  {
+    // No event ever came back, treat it as a failed attempt
+    WiFi.disconnect();
+    _staState = STA_WAITING_RETRY;
+  }
+  else if (state == STA_WAITING_RETRY && currentTime - _staAttemptTime >= _staRetryDelay)
+  {
+    _staRetryDelay = min(_staRetryDelay * 2, staRetryMaxInterval);
+    WiFi_Connect();
+  }
+}
+// MARK: WiFi_StatusJson
+String WiFi_StatusJson()
+{
+  static const char *stateNames[] = {"idle", "connecting", "connected", "waiting"};
+  DeviceConfig current;
+  Config_Snapshot(current);
+  JsonDocument doc;
+  doc["apSsid"] = current.apSsid;
+  doc["apIP"] = WiFi.softAPIP().toString();
+  doc["apClients"] = WiFi.softAPgetStationNum();
+  doc["staSsid"] = current.staSsid;
+  doc["staState"] = stateNames[_staState];
+  doc["staAttempts"] = _staAttempts;
+  doc["staLastReason"] = _staLastReason;
+  if (_staState == STA_CONNECTED)
+  {
+    doc["staIP"] = WiFi.localIP().toString();
+    doc["rssi"] = WiFi.RSSI();
+    doc["hostname"] = String(DEFAULT_HOSTNAME) + ".local";
+  }
+  else if (_staState == STA_WAITING_RETRY)
+  {
+    ulong elapsed = millis() - _staAttemptTime;
+    doc["nextRetryMs"] = elapsed < _staRetryDelay ? _staRetryDelay - elapsed : 0;
   }
+
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
 }
 
 void Webserver_Init()
@@ -114,9 +235,11 @@ void Webserver_Init()
   server.addHandler(&countEvents);
   server.addHandler(&runningAverageEvents);
   server.addHandler(&timeEvents);
+  server.addHandler(&historyEvents);
+  telemetrySocket.onEvent(Telemetry_Event);
+  server.addHandler(&telemetrySocket);
   Webserver_Routes();
   server.serveStatic("/", LittleFS, "/").setDefaultFile("index.html");
-  server.serveStatic("/data", SD, "/").setCacheControl("max-age=60");
   server.begin();
 #ifdef DEBUG
   Serial.println("Server Started");
@@ -132,25 +255,35 @@ void Webserver_Routes()
       if (!error) {
         long timeValue = doc["time"];
         rtc.adjust(DateTime(timeValue));
+        Clock_Sync(true);
         request->send(200, "text/plain", "OK");
       } else {
         request->send(400, "text/plain", "Bad Request: JSON parse error");
       } });
-  server.on("/wifiSetting", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+  server.on("/api/config", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-      JsonDocument doc;
-      DeserializationError error = deserializeJson(doc, data, len);
-      if (!error) {
-        String ssid = doc["ssid"].as<String>();
-        String password = doc["password"].as<String>();
-        AP_SSID = ssid;
-        AP_PASSWORD = password;
-        preferences.putString("ssid", ssid);
-        preferences.putString("password", password);
-        request->send(200, "text/plain", "OK");
-      } else {
-        request->send(400, "text/plain", "Bad Request: JSON parse error");
-      } });
+      DeviceConfig current;
+      Config_Snapshot(current);
+      String etag = Config_ETag(current);
+      if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == etag) {
+        AsyncWebServerResponse *response = request->beginResponse(304);
+        response->addHeader("ETag", etag);
+        request->send(response);
+        return;
+      }
+      AsyncWebServerResponse *response = request->beginResponse(200, "application/json", Config_ToJson(current));
+      response->addHeader("ETag", etag);
+      request->send(response); });
+  server.on("/api/config", HTTP_PATCH, [](AsyncWebServerRequest *request) {}, NULL, Config_Handler);
+  server.on("/wifiStatus", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", WiFi_StatusJson()); });
+  server.on("/mqttStatus", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", Mqtt_StatusJson()); });
+  server.on("/data/*", HTTP_GET, Data_Handler);
+  server.on("/api/series", HTTP_GET, Series_Handler);
+  server.on("/api/history", HTTP_GET, History_Handler);
+  server.on("/sdStatus", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", SD_StatusJson()); });
   server.on("/getCount", HTTP_GET, [](AsyncWebServerRequest *request)
             {
       String count = String(_count);
@@ -169,8 +302,11 @@ void Webserver_Routes()
         if (!fileName.startsWith("/")) {
             fileName = "/" + fileName;
         }
-        if (SD.remove(fileName)) { // SD.remove expects absolute path
+        bool busy;
+        if (SD_RemoveNow(fileName, busy)) { // SD.remove expects absolute path
             request->send(200, "text/plain", "File deleted: " + fileName);
+        } else if (busy) {
+            request->send(503, "text/plain", "SD card busy, try again");
         } else {
             request->send(500, "text/plain", "Failed to delete file: " + fileName);
         }
@@ -189,75 +325,421 @@ void Webserver_Routes()
 #ifdef DEBUG
       Serial.printf("Listing directory: %s\n", path.c_str());
 #endif
-      String jsonString = listDir(SD, path.c_str(), 2); // List 2 levels deep
+      bool busy = false;
+      String jsonString = listDir(SD, path.c_str(), 2, &busy); // List 2 levels deep
+      if (busy) {
+        request->send(503, "text/plain", "SD card busy, try again");
+        return;
+      }
       request->send(200, "application/json", jsonString); });
+  server.on("/api/ota", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", Ota_StatusJson()); });
+  server.on("/api/ota", HTTP_POST, Ota_Request, NULL, Ota_Body);
   server.on("/restart", HTTP_GET, [](AsyncWebServerRequest *request)
             {
       request->send(200, "text/plain", "OK");
       delay(1000);
       ESP.restart(); });
+}
 
-  server.on("/setSchedule", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
-            {
-    JsonDocument doc;
-    DeserializationError error = deserializeJson(doc, data, len);
-    if (error) {
-      request->send(400, "text/plain", "Bad Request: JSON parse error");
-      return;
+void Webserver_Loop()
+{
+  WiFi_Loop();
+  Telemetry_Loop();
+  // dnsServer.processNextRequest(); // Typically not needed with ESPAsyncWebServer
+}
+
+void Send_Event(AsyncEventSource &eventSource, const String &eventData)
+{
+  eventSource.send(eventData.c_str());
+}
+// MARK: Telemetry
+static uint16_t _telemetrySeq = 0;
+static uint32_t _telemetryCount = 0;
+static float _telemetryCPM = 0;
+static float _telemetryCPH = 0;
+static uint32_t _telemetryTime = 0;
+static bool _telemetryActive = true;
+static uint32_t _telemetryNext = 0;
+static ulong _lastTelemetryTime = 0;
+// Connected clients, kept here so loop() never walks the socket's own client
+// list, which the web server task changes under its lock
+struct TelemetryClient
+{
+  uint32_t id; // 0 = free
+  bool stale;  // Owed a snapshot
+};
+static TelemetryClient _telemetryClients[TELEMETRY_MAX_CLIENTS * 2]; // Room for new clients until cleanupClients() runs
+static portMUX_TYPE _telemetryMux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t *putU16(uint8_t *p, uint16_t v)
+{
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static uint8_t *putU32(uint8_t *p, uint32_t v)
+{
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static uint8_t *putF32(uint8_t *p, float v)
+{
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+// Finds the slot of id (0 for a free one) and sets it to newId and stale.
+// Called from both tasks. Returns false if there is no such slot.
+static bool updateTelemetryClient(uint32_t id, uint32_t newId, bool stale)
+{
+  bool found = false;
+  portENTER_CRITICAL(&_telemetryMux);
+  for (TelemetryClient &client : _telemetryClients)
+  {
+    if (client.id == id)
+    {
+      client.id = newId;
+      client.stale = stale;
+      found = true;
+      break;
     }
+  }
+  portEXIT_CRITICAL(&_telemetryMux);
+  return found;
+}
 
-    bool reqEnabled = doc["enabled"] | scheduleEnabled; 
-    int reqStartHour = doc["startHour"] | startHour;
-    int reqStartMinute = doc["startMinute"] | startMinute;
-    int reqStopHour = doc["stopHour"] | stopHour;
-    int reqStopMinute = doc["stopMinute"] | stopMinute;
+// Full state as of the last delta frame, so a client can apply the next one on top.
+// Deltas still queued ahead of it are older, the client applies or skips them
+// by sequence number. Only called from Telemetry_Loop().
+static bool Telemetry_SendSnapshot(uint32_t id)
+{
+  uint8_t frame[25];
+  uint8_t *p = frame;
+  *p++ = TELEMETRY_SNAPSHOT;
+  *p++ = TELEMETRY_VERSION;
+  p = putU16(p, _telemetrySeq);
+  p = putU32(p, _telemetryCount);
+  p = putF32(p, _telemetryCPM);
+  p = putF32(p, _telemetryCPH);
+  p = putU32(p, _telemetryTime);
+  *p++ = _telemetryActive;
+  p = putU32(p, _telemetryNext);
+  return telemetrySocket.binary(id, frame, p - frame) == AsyncWebSocket::ENQUEUED;
+}
 
-    if (reqStartHour < 0 || reqStartHour > 23 || reqStartMinute < 0 || reqStartMinute > 59 ||
-        reqStopHour < 0 || reqStopHour > 23 || reqStopMinute < 0 || reqStopMinute > 59) {
-      request->send(400, "text/plain", "Bad Request: Invalid time values.");
+void Telemetry_Event(AsyncWebSocket *socket, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+  if (type == WS_EVT_CONNECT)
+  {
+    // Slow viewers are resynchronised with a snapshot instead of being dropped.
+    // The first snapshot also comes from Telemetry_Loop(), so it is consistent
+    // with the sequence numbers of the deltas that follow.
+    client->setCloseClientOnQueueFull(false);
+    if (!updateTelemetryClient(0, client->id(), true))
+    {
+      // More connections than cleanupClients() has caught up with, it would never get a snapshot
+      client->close(1013, "Too many telemetry clients");
       return;
     }
+#ifdef DEBUG
+    Serial.printf("Telemetry: Client %u connected, %u total\n", client->id(), socket->count());
+#endif
+  }
+  else if (type == WS_EVT_DISCONNECT)
+  {
+    updateTelemetryClient(client->id(), 0, false);
+  }
+}
+
+void Telemetry_Loop()
+{
+  unsigned long currentTime = millis();
+  if (currentTime - _lastTelemetryTime < telemetryInterval)
+  {
+    return;
+  }
+  _lastTelemetryTime = currentTime;
+
+  uint8_t frame[32];
+  uint8_t *p = frame + 3; // Type and sequence are filled in once there is something to send
+  bool resync = false;
+
+  uint32_t count = _count;
+  if (count != _telemetryCount)
+  {
+    if (count < _telemetryCount || count - _telemetryCount > UINT16_MAX)
+    {
+      // A reset or a jump that does not fit a record, everyone gets a snapshot
+      resync = true;
+    }
+    else
+    {
+      *p++ = TELEMETRY_REC_COUNT;
+      p = putU16(p, count - _telemetryCount);
+    }
+    _telemetryCount = count;
+  }
+  if ((float)_runningAverageCPM != _telemetryCPM || (float)_runningAverageCPH != _telemetryCPH)
+  {
+    _telemetryCPM = _runningAverageCPM;
+    _telemetryCPH = _runningAverageCPH;
+    *p++ = TELEMETRY_REC_RATE;
+    p = putF32(p, _telemetryCPM);
+    p = putF32(p, _telemetryCPH);
+  }
+  if (_currentUnix != _telemetryTime)
+  {
+    _telemetryTime = _currentUnix;
+    *p++ = TELEMETRY_REC_TIME;
+    p = putU32(p, _telemetryTime);
+  }
+  if (_scheduleActive != _telemetryActive || _scheduleNextTransition != _telemetryNext)
+  {
+    _telemetryActive = _scheduleActive;
+    _telemetryNext = _scheduleNextTransition;
+    *p++ = TELEMETRY_REC_SCHEDULE;
+    *p++ = _telemetryActive;
+    p = putU32(p, _telemetryNext);
+  }
+
+  bool hasDelta = p > frame + 3;
+  if (hasDelta || resync)
+  {
+    _telemetrySeq++;
+  }
+  frame[0] = TELEMETRY_DELTA;
+  putU16(frame + 1, _telemetrySeq);
+
+  // Sends go through the socket by id, which looks the client up under its lock
+  TelemetryClient clients[TELEMETRY_MAX_CLIENTS * 2];
+  portENTER_CRITICAL(&_telemetryMux);
+  memcpy(clients, _telemetryClients, sizeof(clients));
+  portEXIT_CRITICAL(&_telemetryMux);
+  for (const TelemetryClient &client : clients)
+  {
+    if (client.id == 0)
+      continue;
+    // The queue holds at most WS_MAX_QUEUED_MESSAGES frames, a client that has
+    // not taken them is not sent more deltas to work through later
+    bool room = telemetrySocket.availableForWrite(client.id);
+    if (client.stale || resync)
+    {
+      // Skip the deltas it missed, one snapshot as soon as its queue has room
+      bool sent = room && Telemetry_SendSnapshot(client.id);
+      if (sent == client.stale)
+        updateTelemetryClient(client.id, client.id, !sent);
+    }
+    else if (hasDelta && (!room || telemetrySocket.binary(client.id, frame, p - frame) != AsyncWebSocket::ENQUEUED))
+    {
+      // Behind, it has a gap now and gets a snapshot once it catches up
+      updateTelemetryClient(client.id, client.id, true);
+    }
+  }
+  telemetrySocket.cleanupClients(TELEMETRY_MAX_CLIENTS);
+}
+// MARK: History
+// Counts per minute for the last 24 hours, 2 bytes a minute, in RTC slow
+// memory. It keeps its contents through a software reset, watchdog or crash,
+// only a power cycle loses it. The running minute's slot is counted into
+// directly, so a reset loses nothing already counted.
+// The count itself is not stored per minute, /api/history works it out
+// backwards from the current one. Whenever the count jumps, a reset or the
+// value restored at boot, a mark records the count just before so that walk
+// does not cross the jump. Written from loop(), marks also from /resetCount,
+// under _historyMux.
+struct HistoryMark
+{
+  uint32_t minute; // 0 for an unused mark
+  uint32_t before; // Count just before the jump
+  uint16_t slot;   // What the minute had counted by then
+};
+
+struct MinuteHistory
+{
+  uint32_t magic;
+  uint32_t check;  // Mirrors the fields below, tells a kept ring from power-on garbage
+  uint32_t minute; // Running minute, Unix time / 60
+  uint16_t head;   // Its slot
+  uint16_t filled; // Minutes recorded, the running one included
+  uint16_t counts[HISTORY_MINUTES];
+  HistoryMark marks[HISTORY_MAX_MARKS];
+  uint8_t nextMark; // Overwritten next, the oldest
+};
+static RTC_NOINIT_ATTR MinuteHistory _history;
+static portMUX_TYPE _historyMux = portMUX_INITIALIZER_UNLOCKED;
 
-    scheduleEnabled = reqEnabled;
-    startHour = reqStartHour;
-    startMinute = reqStartMinute;
-    stopHour = reqStopHour;
-    stopMinute = reqStopMinute;
+static uint32_t History_Check()
+{
+  return ~(_history.minute ^ ((uint32_t)_history.head << 16) ^ _history.filled);
+}
+
+static void History_Clear(uint32_t minute)
+{
+  memset(_history.counts, 0, sizeof(_history.counts));
+  memset(_history.marks, 0, sizeof(_history.marks));
+  _history.nextMark = 0;
+  _history.minute = minute;
+  _history.head = 0;
+  _history.filled = 1;
+  _history.check = History_Check();
+  _history.magic = HISTORY_MAGIC;
+}
 
-    preferences.putBool(PREF_KEY_SCH_ENABLED, scheduleEnabled);
-    preferences.putInt(PREF_KEY_SCH_START_H, startHour);
-    preferences.putInt(PREF_KEY_SCH_START_M, startMinute);
-    preferences.putInt(PREF_KEY_SCH_STOP_H, stopHour);
-    preferences.putInt(PREF_KEY_SCH_STOP_M, stopMinute);
+// Moves the ring on to minute, publishing the last minute it completes
+static void History_Advance(uint32_t minute)
+{
+  if (minute < _history.minute)
+  {
+    // Small corrections of the clock keep counting into the running minute
+    if (_history.minute - minute > HISTORY_MAX_SKEW)
+      History_Clear(minute);
+    return;
+  }
+  if (minute - _history.minute >= HISTORY_MINUTES)
+  {
+    History_Clear(minute);
+    return;
+  }
+  if (minute == _history.minute)
+  {
+    return;
+  }
+  // Counts so far went into the running slot, so _count is its closing total
+  bool gap = minute - _history.minute > 1;
+  uint32_t completed = _history.minute;
+  uint16_t completedCount = _history.counts[_history.head];
+  uint32_t total = _count;
+  portENTER_CRITICAL(&_historyMux);
+  while (_history.minute < minute)
+  {
+    _history.head = (_history.head + 1) % HISTORY_MINUTES;
+    _history.counts[_history.head] = 0;
+    _history.minute++;
+    if (_history.filled < HISTORY_MINUTES)
+      _history.filled++;
+  }
+  _history.check = History_Check();
+  portEXIT_CRITICAL(&_historyMux);
+  // After a gap, e.g. a restart, clients see the next push out of step and fetch the history again
+  if (gap)
+    return;
+  Send_Event(historyEvents, String(completed * 60) + "," + String(completedCount) + "," + String(total));
+}
 
+void History_Init()
+{
+  uint32_t minute = Clock_Now() / 60;
+  if (_history.magic != HISTORY_MAGIC || _history.check != History_Check() ||
+      _history.head >= HISTORY_MINUTES || _history.filled == 0 || _history.filled > HISTORY_MINUTES)
+  {
+    History_Clear(minute);
 #ifdef DEBUG
-    Serial.println("Schedule updated via web:");
-    Serial.printf("Enabled: %s, Start: %02d:%02d, Stop: %02d:%02d\n",
-                  scheduleEnabled ? "true" : "false", startHour, startMinute, stopHour, stopMinute);
+    Serial.println("Minute history started");
 #endif
-    request->send(200, "text/plain", "OK"); });
-  server.on("/getSchedule", HTTP_GET, [](AsyncWebServerRequest *request)
-            {
-    JsonDocument doc;
-    doc["enabled"] = scheduleEnabled;
-    doc["startHour"] = startHour;
-    doc["startMinute"] = startMinute;
-    doc["stopHour"] = stopHour;
-    doc["stopMinute"] = stopMinute;
+    return;
+  }
+  // Minutes spent restarting are recorded as empty
+  History_Advance(minute);
+#ifdef DEBUG
+  Serial.printf("Minute history kept, %u minutes\n", _history.filled);
+#endif
+}
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    request->send(200, "application/json", jsonString); });
+void History_Count()
+{
+  portENTER_CRITICAL(&_historyMux);
+  if (_history.counts[_history.head] < UINT16_MAX)
+    _history.counts[_history.head]++;
+  portEXIT_CRITICAL(&_historyMux);
 }
 
-void Webserver_Loop()
+// Call right after _count is set to anything but the next count
+void History_Mark(uint32_t before)
 {
-  // dnsServer.processNextRequest(); // Typically not needed with ESPAsyncWebServer
+  portENTER_CRITICAL(&_historyMux);
+  HistoryMark &mark = _history.marks[_history.nextMark];
+  mark.minute = _history.minute;
+  mark.before = before;
+  mark.slot = _history.counts[_history.head];
+  _history.nextMark = (_history.nextMark + 1) % HISTORY_MAX_MARKS;
+  portEXIT_CRITICAL(&_historyMux);
 }
 
-void Send_Event(AsyncEventSource &eventSource, const String &eventData)
+void History_Loop()
 {
-  eventSource.send(eventData.c_str());
+  History_Advance(_currentUnix / 60);
+}
+
+// GET /api/history
+// {"start":<Unix time of the oldest minute>,"step":60,"count":<count now>,"counts":[...],"totals":[...]}
+// Oldest first, the last entry is the running minute. totals is the count at
+// the end of each minute, or now for the running one. Served from RAM only.
+void History_Handler(AsyncWebServerRequest *request)
+{
+  uint32_t *totals = (uint32_t *)malloc(HISTORY_MINUTES * sizeof(uint32_t));
+  if (totals == NULL)
+  {
+    request->send(503, "text/plain", "Out of memory");
+    return;
+  }
+  String json;
+  // loop() may move the ring on meanwhile, then the reply is built again
+  for (uint8_t attempt = 0; attempt < 3; attempt++)
+  {
+    HistoryMark marks[HISTORY_MAX_MARKS];
+    portENTER_CRITICAL(&_historyMux);
+    uint32_t minute = _history.minute;
+    uint16_t head = _history.head;
+    uint16_t filled = _history.filled;
+    uint32_t count = _count;
+    uint8_t nextMark = _history.nextMark;
+    memcpy(marks, _history.marks, sizeof(marks));
+    portEXIT_CRITICAL(&_historyMux);
+
+    // Backwards from now, stepping over each jump at the oldest mark of its minute
+    int64_t total = count;
+    for (int i = filled - 1; i >= 0; i--)
+    {
+      totals[i] = max(total, (int64_t)0);
+      uint32_t at = minute - (filled - 1 - i);
+      total -= _history.counts[(head + HISTORY_MINUTES - filled + 1 + i) % HISTORY_MINUTES];
+      for (uint8_t k = 0; k < HISTORY_MAX_MARKS; k++)
+      {
+        const HistoryMark &mark = marks[(nextMark + k) % HISTORY_MAX_MARKS];
+        if (mark.minute == at)
+        {
+          total = (int64_t)mark.before - mark.slot;
+          break;
+        }
+      }
+    }
+
+    json = "";
+    json.reserve(64 + filled * 12);
+    json += "{\"start\":" + String((minute - filled + 1) * 60) + ",\"step\":60,\"count\":" + String(count) + ",\"counts\":[";
+    for (uint16_t i = 0; i < filled; i++)
+    {
+      if (i > 0)
+        json += ',';
+      json += _history.counts[(head + HISTORY_MINUTES - filled + 1 + i) % HISTORY_MINUTES];
+    }
+    json += "],\"totals\":[";
+    for (uint16_t i = 0; i < filled; i++)
+    {
+      if (i > 0)
+        json += ',';
+      json += totals[i];
+    }
+    json += "]}";
+    if (_history.minute == minute)
+      break;
+  }
+  free(totals);
+  AsyncWebServerResponse *response = request->beginResponse(200, "application/json", json);
+  response->addHeader("Cache-Control", "no-store");
+  request->send(response);
 }
 // MARK: LCD_Init
 void LCD_Init()
@@ -270,6 +752,8 @@ void Preferences_Init()
 {
   preferences.begin("barrel");
   _count = preferences.getUInt(PREFERENCES_KEY_NAME, 0);
+  // After a crash the minute history may hold counts the saved value missed
+  History_Mark(_count);
   long unix = preferences.getLong("lastDate", _currentDate.unixtime());
   _lastDate = DateTime(unix);
 
@@ -278,20 +762,8 @@ void Preferences_Init()
   _lastTimeCheck = preferences.getULong("lastTimeCheck", 0);
   _lastCountCheck = preferences.getUInt("lastCountCheck", 0);
   _lastLogCount = preferences.getUInt("lastLogCount", 0);
-  AP_SSID = preferences.getString("ssid", DEFAULT_AP_SSID);
-  AP_PASSWORD = preferences.getString("password", DEFAULT_AP_PASSWORD);
 
-  scheduleEnabled = preferences.getBool(PREF_KEY_SCH_ENABLED, false);
-  startHour = preferences.getInt(PREF_KEY_SCH_START_H, 7);
-  startMinute = preferences.getInt(PREF_KEY_SCH_START_M, 0);
-  stopHour = preferences.getInt(PREF_KEY_SCH_STOP_H, 16);
-  stopMinute = preferences.getInt(PREF_KEY_SCH_STOP_M, 0);
-
-#ifdef DEBUG
-  Serial.println("Loaded schedule settings from Preferences:");
-  Serial.printf("Enabled: %s, Start: %02d:%02d, Stop: %02d:%02d\n",
-                scheduleEnabled ? "true" : "false", startHour, startMinute, stopHour, stopMinute);
-#endif
+  Config_Load();
 
   if (_lastTimeCheck == 0)
   {
@@ -302,6 +774,9 @@ void Preferences_Init()
 // MARK: Save_To_Preferences
 void Save_To_Preferences(ulong interval)
 {
+  // Settings are written as soon as they change, and only then
+  Config_Save();
+
   unsigned long currentTime = millis();
   if (currentTime - _lastSaveTime > interval)
   {
@@ -312,24 +787,20 @@ void Save_To_Preferences(ulong interval)
     preferences.putULong("lastTimeCheck", _lastTimeCheck);
     preferences.putUInt("lastCountCheck", _lastCountCheck);
     preferences.putUInt("lastLogCount", _lastLogCount);
-    preferences.putString("ssid", AP_SSID);
-    preferences.putString("password", AP_PASSWORD);
-    preferences.putBool(PREF_KEY_SCH_ENABLED, scheduleEnabled);
-    preferences.putInt(PREF_KEY_SCH_START_H, startHour);
-    preferences.putInt(PREF_KEY_SCH_START_M, startMinute);
-    preferences.putInt(PREF_KEY_SCH_STOP_H, stopHour);
-    preferences.putInt(PREF_KEY_SCH_STOP_M, stopMinute);
+    Mqtt_SaveState();
     _lastSaveTime = currentTime;
 #ifdef DEBUG
     // ESP_LOGI("PREFERENCES", "Saved all settings to preferences."); // Use Serial.println for consistency if ESP_LOG not configured
-    Serial.println("Saved all settings to preferences.");
+    Serial.println("Saved counter state to preferences.");
 #endif
   }
 }
 // MARK: Reset_Count
 void Reset_Count()
 {
+  uint32_t before = _count;
   _count = 0;
+  History_Mark(before);
   _runningAverageCPM = 0.0;
   _runningAverageCPH = 0.0;
   _lastCountCheck = 0;
@@ -382,325 +853,3661 @@ void Update_Running_Averages()
     _lastCountCheck = _count;
   }
 }
-// MARK: isTimeWithinScheduledRange
-bool isTimeWithinScheduledRange(const DateTime &now)
+// MARK: Config
+static bool _configDirty = false;
+
+// config is only written by loop(), in Config_Loop(). The web server task
+// reads it through Config_Snapshot() and hands changes over in _configPending.
+static portMUX_TYPE _configMux = portMUX_INITIALIZER_UNLOCKED;
+static DeviceConfig _configPending;
+static bool _configPendingSet = false;
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t len);
+
+void Config_Defaults(DeviceConfig &cfg)
 {
-  if (!scheduleEnabled)
-  {
-    return true;
-  }
+  // Zeroed first so padding bytes, and with them the CRC, are deterministic
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.version = CONFIG_VERSION;
+  cfg.size = offsetof(DeviceConfig, crc);
+  strlcpy(cfg.apSsid, DEFAULT_AP_SSID, sizeof(cfg.apSsid));
+  strlcpy(cfg.apPassword, DEFAULT_AP_PASSWORD, sizeof(cfg.apPassword));
+  strlcpy(cfg.staSsid, DEFAULT_STA_SSID, sizeof(cfg.staSsid));
+  strlcpy(cfg.staPassword, DEFAULT_STA_PASSWORD, sizeof(cfg.staPassword));
+  cfg.logInterval = DEFAULT_LOG_INTERVAL;
+  // Schedule disabled, 07:00-16:00 every day once enabled
+  cfg.scheduleEnabled = false;
+  cfg.shifts[0] = {ALL_WEEKDAYS, 7 * 60, 16 * 60};
+  cfg.shiftCount = 1;
+  cfg.mqttQos = 1;
+  cfg.mqttBatch = 6;
+  cfg.mqttInterval = 10;
+  strlcpy(cfg.mqttTopic, DEFAULT_MQTT_TOPIC, sizeof(cfg.mqttTopic));
+  cfg.logMode = LOG_MODE_INTERVAL;
+  cfg.logMaxGap = DEFAULT_LOG_MAX_GAP;
+  cfg.logCountBand = DEFAULT_LOG_COUNT_BAND;
+  cfg.logRateBand = DEFAULT_LOG_RATE_BAND;
+}
 
-  int currentHour = now.hour();
-  int currentMinute = now.minute();
-  long currentTimeInMinutes = currentHour * 60 + currentMinute;
-  long startTimeInMinutes = startHour * 60 + startMinute;
-  long stopTimeInMinutes = stopHour * 60 + stopMinute;
-  bool isActive;
+uint32_t Config_Crc(const DeviceConfig &cfg)
+{
+  return crc32Update(0, (const uint8_t *)&cfg, offsetof(DeviceConfig, crc));
+}
 
-  if (startTimeInMinutes <= stopTimeInMinutes)
-  {
-    isActive = (currentTimeInMinutes >= startTimeInMinutes && currentTimeInMinutes < stopTimeInMinutes);
-  }
-  else
+String Config_ETag(const DeviceConfig &cfg)
+{
+  char etag[12];
+  snprintf(etag, sizeof(etag), "\"%08lx\"", (unsigned long)Config_Crc(cfg));
+  return String(etag);
+}
+
+// Firmware from before the config blob kept every setting in its own key
+static void Config_MigrateLegacy(DeviceConfig &cfg)
+{
+  preferences.getString(PREF_KEY_AP_SSID, cfg.apSsid, sizeof(cfg.apSsid));
+  preferences.getString(PREF_KEY_AP_PASSWORD, cfg.apPassword, sizeof(cfg.apPassword));
+
+  // A single daily window, the first shift of the weekly calendar now
+  cfg.scheduleEnabled = preferences.getBool(PREF_KEY_SCH_ENABLED, false);
+  cfg.shifts[0].start = preferences.getInt(PREF_KEY_SCH_START_H, 7) * 60 + preferences.getInt(PREF_KEY_SCH_START_M, 0);
+  cfg.shifts[0].stop = preferences.getInt(PREF_KEY_SCH_STOP_H, 16) * 60 + preferences.getInt(PREF_KEY_SCH_STOP_M, 0);
+
+  static const char *legacyKeys[] = {PREF_KEY_AP_SSID, PREF_KEY_AP_PASSWORD, PREF_KEY_SCH_ENABLED, PREF_KEY_SCH_START_H,
+                                     PREF_KEY_SCH_START_M, PREF_KEY_SCH_STOP_H, PREF_KEY_SCH_STOP_M};
+  for (const char *key : legacyKeys)
   {
-    isActive = (currentTimeInMinutes >= startTimeInMinutes || currentTimeInMinutes < stopTimeInMinutes);
-  }
-#ifdef DEBUG
-  static bool lastReportedActiveStatus = !isActive;
-  if (isActive != lastReportedActiveStatus || lastReportedActiveStatus == !isActive)
-  { // Print on change or first check
-    Serial.printf("Schedule check: Now %02d:%02d. Range %02d:%02d-%02d:%02d. Counting Active: %s\n",
-                  currentHour, currentMinute, startHour, startMinute, stopHour, stopMinute, isActive ? "YES" : "NO");
-    lastReportedActiveStatus = isActive;
+    if (preferences.isKey(key))
+    {
+      preferences.remove(key);
+    }
   }
-#endif
-  return isActive;
 }
-// MARK: Read_Switches
-void Read_Switches(ulong debounceInterval, bool isActiveLow)
+
+// Brings a blob written by another schema version up to CONFIG_VERSION.
+// Fields are only appended, so the stored bytes were copied over defaults
+// already; each case resets what its successor added, in case trailing
+// padding of the old layout landed on it.
+static void Config_Migrate(DeviceConfig &cfg, uint16_t fromVersion)
 {
-  if (!isTimeWithinScheduledRange(_currentDate))
+  switch (fromVersion)
   {
-    return;
+  case 1:
+    cfg.logMode = LOG_MODE_INTERVAL;
+    cfg.logMaxGap = DEFAULT_LOG_MAX_GAP;
+    cfg.logCountBand = DEFAULT_LOG_COUNT_BAND;
+    cfg.logRateBand = DEFAULT_LOG_RATE_BAND;
+    // fall through
+  default:
+    break;
   }
+  cfg.version = CONFIG_VERSION;
+  cfg.size = offsetof(DeviceConfig, crc);
+}
 
-  unsigned long currentTime = millis();
-  bool pin1_activated_this_cycle = false;
-  bool pin2_activated_this_cycle = false;
+void Config_Load()
+{
+  Config_Defaults(config);
 
-  bool currentReadingPin1 = digitalRead(SWITCH_PIN_1);
-  if (currentReadingPin1 != debouncingStatePin1)
-  {
-    lastDebounceTimePin1 = currentTime;
-    debouncingStatePin1 = currentReadingPin1;
-  }
-  if ((currentTime - lastDebounceTimePin1) > debounceInterval)
+  size_t len = preferences.getBytesLength(PREF_KEY_CONFIG);
+  uint8_t *blob = len >= 2 * sizeof(uint32_t) && len <= 4096 ? (uint8_t *)malloc(len) : NULL;
+  bool loaded = false;
+  if (blob != NULL && preferences.getBytes(PREF_KEY_CONFIG, blob, len) == len)
   {
-    if (debouncingStatePin1 != debouncedStatePin1)
+    uint16_t version, size;
+    uint32_t crc;
+    memcpy(&version, blob, sizeof(version));
+    memcpy(&size, blob + sizeof(version), sizeof(size));
+    memcpy(&crc, blob + len - sizeof(crc), sizeof(crc));
+    if (size == len - sizeof(crc) && crc32Update(0, blob, size) == crc)
     {
-      debouncedStatePin1 = debouncingStatePin1;
-      if (debouncedStatePin1 == (isActiveLow ? LOW : HIGH))
-      {
-        pin1_activated_this_cycle = true;
-      }
+      // A newer schema is a superset, an older one a prefix
+      memcpy(&config, blob, min((size_t)size, offsetof(DeviceConfig, crc)));
+      Config_Migrate(config, version);
+      // A blob from newer firmware is left alone until something changes
+      _configDirty = version < CONFIG_VERSION;
+      loaded = true;
+    }
+#ifdef DEBUG
+    else
+    {
+      Serial.println("Config: Stored settings are corrupt, using defaults");
     }
+#endif
   }
+  free(blob);
 
-  bool currentReadingPin2 = digitalRead(SWITCH_PIN_2);
-  if (currentReadingPin2 != debouncingStatePin2)
-  {
-    lastDebounceTimePin2 = currentTime;
-    debouncingStatePin2 = currentReadingPin2;
-  }
-  if ((currentTime - lastDebounceTimePin2) > debounceInterval)
+  if (!loaded)
   {
-    if (debouncingStatePin2 != debouncedStatePin2)
+    Config_Defaults(config);
+    if (len == 0)
     {
-      debouncedStatePin2 = debouncingStatePin2;
-      if (debouncedStatePin2 == (isActiveLow ? LOW : HIGH))
-      {
-        pin2_activated_this_cycle = true;
-      }
+      Config_MigrateLegacy(config);
     }
+    _configDirty = true;
   }
 
-  if (pin1_activated_this_cycle || pin2_activated_this_cycle)
-  {
-    _count++;
-    Send_Event(countEvents, String(_count));
+  // Strings from storage are trusted no further than the validation on the way in
+  config.apSsid[sizeof(config.apSsid) - 1] = '\0';
+  config.apPassword[sizeof(config.apPassword) - 1] = '\0';
+  config.staSsid[sizeof(config.staSsid) - 1] = '\0';
+  config.staPassword[sizeof(config.staPassword) - 1] = '\0';
+  config.mqttUri[sizeof(config.mqttUri) - 1] = '\0';
+  config.mqttUsername[sizeof(config.mqttUsername) - 1] = '\0';
+  config.mqttPassword[sizeof(config.mqttPassword) - 1] = '\0';
+  config.mqttTopic[sizeof(config.mqttTopic) - 1] = '\0';
+  config.shiftCount = min(config.shiftCount, (uint8_t)MAX_SHIFTS);
+  config.holidayCount = min(config.holidayCount, (uint8_t)MAX_HOLIDAYS);
+  if (config.logMode > LOG_MODE_DEADBAND)
+    config.logMode = LOG_MODE_INTERVAL;
+  Schedule_Invalidate();
+
 #ifdef DEBUG
-    Serial.print("Count: " + String(_count) + " (Triggered by: ");
-    if (pin1_activated_this_cycle)
-      Serial.print("SW1 ");
+  Serial.printf("Config: v%u, schedule %s with %u shift(s) and %u holiday(s)\n", config.version,
+                config.scheduleEnabled ? "enabled" : "disabled", config.shiftCount, config.holidayCount);
+#endif
+}
+
+// NVS replaces a blob only once the new copy is fully written, so a power cut
+// leaves either the old or the new settings, never a mix.
+void Config_Save()
+{
+  if (!_configDirty)
+  {
+    return;
+  }
+  _configDirty = false;
+  DeviceConfig saved = config;
+  saved.version = CONFIG_VERSION;
+  saved.size = offsetof(DeviceConfig, crc);
+  saved.crc = Config_Crc(saved);
+  if (preferences.putBytes(PREF_KEY_CONFIG, &saved, sizeof(saved)) != sizeof(saved))
+  {
+    _configDirty = true;
+#ifdef DEBUG
+    Serial.println("Config: Failed to save settings");
+#endif
+  }
+#ifdef DEBUG
+  else
+  {
+    Serial.println("Config: Saved settings");
+  }
+#endif
+}
+
+String Config_ToJson(const DeviceConfig &cfg)
+{
+  // Passwords are write-only
+  JsonDocument doc;
+  doc["version"] = cfg.version;
+  JsonObject ap = doc["ap"].to<JsonObject>();
+  ap["ssid"] = cfg.apSsid;
+  JsonObject sta = doc["sta"].to<JsonObject>();
+  sta["ssid"] = cfg.staSsid;
+  JsonObject log = doc["log"].to<JsonObject>();
+  log["interval"] = cfg.logInterval;
+  log["mode"] = cfg.logMode == LOG_MODE_DEADBAND ? "deadband" : "interval";
+  log["maxGap"] = cfg.logMaxGap;
+  log["countBand"] = cfg.logCountBand;
+  log["rateBand"] = cfg.logRateBand;
+  Schedule_ToJson(doc["schedule"].to<JsonObject>(), cfg);
+  Mqtt_SettingsToJson(doc["mqtt"].to<JsonObject>(), cfg);
+
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
+}
+
+// Copies a string member if present, refusing anything that would not fit
+static bool copyConfigString(JsonVariantConst value, char *dst, size_t size, const char *name, String &error)
+{
+  if (value.isNull())
+  {
+    return true;
+  }
+  const char *text = value.as<const char *>();
+  if (text == nullptr || strlen(text) >= size)
+  {
+    error = String(name) + " is invalid or too long.";
+    return false;
+  }
+  strlcpy(dst, text, size);
+  return true;
+}
+
+// The settings as the web sees them, including a patch loop() has not
+// applied yet. Safe to call from any task.
+void Config_Snapshot(DeviceConfig &cfg)
+{
+  portENTER_CRITICAL(&_configMux);
+  cfg = _configPendingSet ? _configPending : config;
+  portEXIT_CRITICAL(&_configMux);
+}
+
+// Validates every section against a copy first, so a bad field anywhere
+// leaves the whole configuration untouched. Runs in the web server task, the
+// result is applied by Config_Loop().
+bool Config_Patch(JsonVariantConst doc, String &error)
+{
+  if (!doc.is<JsonObjectConst>())
+  {
+    error = "Expected a JSON object.";
+    return false;
+  }
+  DeviceConfig current;
+  Config_Snapshot(current);
+  DeviceConfig next = current;
+
+  JsonVariantConst ap = doc["ap"];
+  if (!copyConfigString(ap["ssid"], next.apSsid, sizeof(next.apSsid), "AP SSID", error) ||
+      !copyConfigString(ap["password"], next.apPassword, sizeof(next.apPassword), "AP password", error))
+  {
+    return false;
+  }
+  size_t apPasswordLen = strlen(next.apPassword);
+  if (next.apSsid[0] == '\0' || (apPasswordLen > 0 && apPasswordLen < 8))
+  {
+    error = "AP needs an SSID and a password of at least 8 characters or none.";
+    return false;
+  }
+
+  JsonVariantConst sta = doc["sta"];
+  if (!copyConfigString(sta["ssid"], next.staSsid, sizeof(next.staSsid), "Station SSID", error) ||
+      !copyConfigString(sta["password"], next.staPassword, sizeof(next.staPassword), "Station password", error))
+  {
+    return false;
+  }
+
+  int logInterval = doc["log"]["interval"] | (int)next.logInterval;
+  if (logInterval < 1 || logInterval > 3600)
+  {
+    error = "Invalid log interval.";
+    return false;
+  }
+  next.logInterval = logInterval;
+  const char *mode = doc["log"]["mode"];
+  if (mode != nullptr)
+  {
+    if (strcmp(mode, "interval") == 0)
+      next.logMode = LOG_MODE_INTERVAL;
+    else if (strcmp(mode, "deadband") == 0)
+      next.logMode = LOG_MODE_DEADBAND;
+    else
+    {
+      error = "Log mode must be interval or deadband.";
+      return false;
+    }
+  }
+  long maxGap = doc["log"]["maxGap"] | (long)next.logMaxGap;
+  long countBand = doc["log"]["countBand"] | (long)next.logCountBand;
+  float rateBand = doc["log"]["rateBand"] | next.logRateBand;
+  if (maxGap < 1 || maxGap > LOG_MAX_GAP_LIMIT || countBand < 0 || countBand > UINT16_MAX || !(rateBand >= 0 && rateBand <= 10000))
+  {
+    error = "Invalid log deadband.";
+    return false;
+  }
+  next.logMaxGap = maxGap;
+  next.logCountBand = countBand;
+  next.logRateBand = rateBand;
+
+  if (!doc["schedule"].isNull() && !Schedule_FromJson(doc["schedule"], next, error))
+  {
+    return false;
+  }
+  if (!doc["mqtt"].isNull() && !Mqtt_SettingsFromJson(doc["mqtt"], next, error))
+  {
+    return false;
+  }
+
+  if (memcmp(&next, &current, offsetof(DeviceConfig, crc)) == 0)
+  {
+    return true;
+  }
+  portENTER_CRITICAL(&_configMux);
+  _configPending = next;
+  _configPendingSet = true;
+  portEXIT_CRITICAL(&_configMux);
+  return true;
+}
+
+// Applies settings patched from the web, and what depends on them
+void Config_Loop()
+{
+  if (!_configPendingSet)
+  {
+    return;
+  }
+  portENTER_CRITICAL(&_configMux);
+  const DeviceConfig &next = _configPending;
+  bool staChanged = strcmp(next.staSsid, config.staSsid) != 0 || strcmp(next.staPassword, config.staPassword) != 0;
+  bool mqttChanged = next.mqttEnabled != config.mqttEnabled || next.mqttQos != config.mqttQos ||
+                     next.mqttBatch != config.mqttBatch || next.mqttInterval != config.mqttInterval ||
+                     strcmp(next.mqttUri, config.mqttUri) != 0 || strcmp(next.mqttUsername, config.mqttUsername) != 0 ||
+                     strcmp(next.mqttPassword, config.mqttPassword) != 0 || strcmp(next.mqttTopic, config.mqttTopic) != 0;
+  bool logChanged = next.logMode != config.logMode || next.logMaxGap != config.logMaxGap ||
+                    next.logCountBand != config.logCountBand || next.logRateBand != config.logRateBand;
+  config = next;
+  _configPendingSet = false;
+  portEXIT_CRITICAL(&_configMux);
+  _configDirty = true;
+
+  // AP changes take effect after a restart, as they always have
+  Schedule_Invalidate();
+  if (staChanged)
+  {
+    WiFi_Reconnect();
+  }
+  if (mqttChanged)
+  {
+    Mqtt_Restart();
+  }
+  if (logChanged)
+  {
+    Log_Restart();
+  }
+#ifdef DEBUG
+  Serial.println("Config: Settings updated via web");
+#endif
+}
+
+// PATCH /api/config. The body may arrive in several parts, it is collected
+// before anything is parsed. If-Match guards against overwriting changes made
+// since the client last read the configuration.
+void Config_Handler(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (total > CONFIG_MAX_BODY)
+  {
+    if (index == 0)
+    {
+      request->send(413, "text/plain", "Payload Too Large");
+    }
+    return;
+  }
+  if (index == 0)
+  {
+    request->_tempObject = malloc(total);
+    if (request->_tempObject == NULL)
+    {
+      request->send(500, "text/plain", "Out of memory");
+      return;
+    }
+  }
+  if (request->_tempObject == NULL)
+  {
+    return;
+  }
+  memcpy((uint8_t *)request->_tempObject + index, data, len);
+  if (index + len < total)
+  {
+    return;
+  }
+
+  DeviceConfig current;
+  Config_Snapshot(current);
+  if (request->hasHeader("If-Match") && request->getHeader("If-Match")->value() != Config_ETag(current))
+  {
+    request->send(412, "text/plain", "Precondition Failed: configuration has changed");
+    return;
+  }
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, (const char *)request->_tempObject, total);
+  if (error)
+  {
+    request->send(400, "text/plain", "Bad Request: JSON parse error");
+    return;
+  }
+  String configError;
+  if (!Config_Patch(doc.as<JsonVariantConst>(), configError))
+  {
+    request->send(400, "text/plain", "Bad Request: " + configError);
+    return;
+  }
+  Config_Snapshot(current);
+  AsyncWebServerResponse *response = request->beginResponse(200, "application/json", Config_ToJson(current));
+  response->addHeader("ETag", Config_ETag(current));
+  request->send(response);
+}
+// MARK: Schedule
+// YYYY-MM-DD within what DateTime can hold, -1 if it is not a real date
+static long parseDateDays(const char *text)
+{
+  static const uint8_t daysInMonth[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  int year, month, day;
+  if (text == nullptr || sscanf(text, "%d-%d-%d", &year, &month, &day) != 3 ||
+      year < 2000 || year > 2099 || month < 1 || month > 12 || day < 1)
+  {
+    return -1;
+  }
+  bool leap = year % 4 == 0; // Exact for 2000-2099
+  if (day > daysInMonth[month - 1] + (month == 2 && leap))
+  {
+    return -1;
+  }
+  return DateTime(year, month, day).unixtime() / 86400;
+}
+
+static int parseClockMinutes(const char *text)
+{
+  int hour, minute;
+  if (text == nullptr || sscanf(text, "%d:%d", &hour, &minute) != 2 ||
+      hour < 0 || hour > 23 || minute < 0 || minute > 59)
+  {
+    return -1;
+  }
+  return hour * 60 + minute;
+}
+
+static String formatClockMinutes(uint16_t minutes)
+{
+  char buf[6];
+  snprintf(buf, sizeof(buf), "%02u:%02u", minutes / 60, minutes % 60);
+  return String(buf);
+}
+
+static bool isHoliday(uint32_t day)
+{
+  for (uint8_t i = 0; i < config.holidayCount; i++)
+  {
+    if (config.holidays[i] == day)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// True when a shift of this entry starts on the given day (days since 1970-01-01)
+static bool shiftStartsOn(const Shift &shift, uint32_t day)
+{
+  uint8_t weekday = (day + 4) % 7; // 1970-01-01 was a Thursday
+  return (shift.days & (1 << weekday)) && !isHoliday(day);
+}
+
+void Schedule_Invalidate()
+{
+  _scheduleNextTransition = 0;
+}
+
+bool Schedule_ActiveAt(uint32_t t)
+{
+  uint32_t day = t / 86400;
+  uint16_t minute = (t % 86400) / 60;
+
+  for (uint8_t i = 0; i < config.shiftCount; i++)
+  {
+    const Shift &shift = config.shifts[i];
+    if (shift.start < shift.stop)
+    {
+      if (minute >= shift.start && minute < shift.stop && shiftStartsOn(shift, day))
+        return true;
+    }
+    else if (shift.start > shift.stop)
+    {
+      if (minute >= shift.start && shiftStartsOn(shift, day))
+        return true;
+      if (minute < shift.stop && day > 0 && shiftStartsOn(shift, day - 1))
+        return true;
+    }
+  }
+  return false;
+}
+
+// Works out the current state and the next instant it changes, so the check
+// in the counting path is a single compare until then.
+void Schedule_Compile(uint32_t now)
+{
+  if (!config.scheduleEnabled)
+  {
+    _scheduleActive = true;
+    _scheduleNextTransition = UINT32_MAX;
+    return;
+  }
+
+  bool active = Schedule_ActiveAt(now);
+  uint32_t today = now / 86400;
+  // Nothing changes in the coming week, look again tomorrow
+  uint32_t next = (today + 1) * 86400;
+  bool found = false;
+
+  // State only changes on a shift boundary, so the earliest boundary with the
+  // opposite state is the next transition.
+  for (uint32_t day = today; day <= today + 7; day++)
+  {
+    for (uint8_t i = 0; i < config.shiftCount; i++)
+    {
+      uint32_t boundaries[2] = {day * 86400 + config.shifts[i].start * 60, day * 86400 + config.shifts[i].stop * 60};
+      for (uint32_t boundary : boundaries)
+      {
+        if (boundary > now && (!found || boundary < next) && Schedule_ActiveAt(boundary) != active)
+        {
+          next = boundary;
+          found = true;
+        }
+      }
+    }
+  }
+
+  _scheduleActive = active;
+  _scheduleNextTransition = next;
+
+#ifdef DEBUG
+  DateTime nextDate(next);
+  char buf[] = "YYYY-MM-DD hh:mm";
+  Serial.printf("Schedule: Counting %s until %s\n", active ? "active" : "paused", nextDate.toString(buf));
+#endif
+}
+
+void Schedule_ToJson(JsonObject doc, const DeviceConfig &cfg)
+{
+  doc["enabled"] = cfg.scheduleEnabled;
+  JsonArray shifts = doc["shifts"].to<JsonArray>();
+  for (uint8_t i = 0; i < cfg.shiftCount; i++)
+  {
+    JsonObject shift = shifts.add<JsonObject>();
+    shift["days"] = cfg.shifts[i].days;
+    shift["start"] = formatClockMinutes(cfg.shifts[i].start);
+    shift["stop"] = formatClockMinutes(cfg.shifts[i].stop);
+  }
+  JsonArray holidays = doc["holidays"].to<JsonArray>();
+  for (uint8_t i = 0; i < cfg.holidayCount; i++)
+  {
+    holidays.add(DateTime((uint32_t)cfg.holidays[i] * 86400).timestamp(DateTime::TIMESTAMP_DATE));
+  }
+}
+
+// Accepts either "shifts"/"holidays" arrays or the flat single-window fields
+bool Schedule_FromJson(JsonVariantConst doc, DeviceConfig &cfg, String &error)
+{
+  if (doc["shifts"].is<JsonArrayConst>())
+  {
+    JsonArrayConst list = doc["shifts"].as<JsonArrayConst>();
+    if (list.size() > MAX_SHIFTS)
+    {
+      error = "Too many shifts.";
+      return false;
+    }
+    cfg.shiftCount = 0;
+    for (JsonVariantConst entry : list)
+    {
+      int start = parseClockMinutes(entry["start"].as<const char *>());
+      int stop = parseClockMinutes(entry["stop"].as<const char *>());
+      int days = entry["days"] | ALL_WEEKDAYS;
+      if (start < 0 || stop < 0 || days < 0 || days > ALL_WEEKDAYS)
+      {
+        error = "Invalid shift.";
+        return false;
+      }
+      cfg.shifts[cfg.shiftCount++] = {(uint8_t)days, (uint16_t)start, (uint16_t)stop};
+    }
+  }
+  else if (doc["startHour"].is<int>() || doc["stopHour"].is<int>())
+  {
+    int reqStartHour = doc["startHour"] | (int)(cfg.shifts[0].start / 60);
+    int reqStartMinute = doc["startMinute"] | (int)(cfg.shifts[0].start % 60);
+    int reqStopHour = doc["stopHour"] | (int)(cfg.shifts[0].stop / 60);
+    int reqStopMinute = doc["stopMinute"] | (int)(cfg.shifts[0].stop % 60);
+    if (reqStartHour < 0 || reqStartHour > 23 || reqStartMinute < 0 || reqStartMinute > 59 ||
+        reqStopHour < 0 || reqStopHour > 23 || reqStopMinute < 0 || reqStopMinute > 59)
+    {
+      error = "Invalid time values.";
+      return false;
+    }
+    cfg.shifts[0] = {ALL_WEEKDAYS, (uint16_t)(reqStartHour * 60 + reqStartMinute), (uint16_t)(reqStopHour * 60 + reqStopMinute)};
+    cfg.shiftCount = 1;
+  }
+
+  if (doc["holidays"].is<JsonArrayConst>())
+  {
+    JsonArrayConst list = doc["holidays"].as<JsonArrayConst>();
+    if (list.size() > MAX_HOLIDAYS)
+    {
+      error = "Too many holidays.";
+      return false;
+    }
+    cfg.holidayCount = 0;
+    for (JsonVariantConst entry : list)
+    {
+      long days = parseDateDays(entry.as<const char *>());
+      if (days < 0)
+      {
+        error = "Invalid holiday date.";
+        return false;
+      }
+      cfg.holidays[cfg.holidayCount++] = days;
+    }
+  }
+
+  cfg.scheduleEnabled = doc["enabled"] | cfg.scheduleEnabled;
+  return true;
+}
+// MARK: isTimeWithinScheduledRange
+bool isTimeWithinScheduledRange(uint32_t now)
+{
+  if (now >= _scheduleNextTransition)
+  {
+    Schedule_Compile(now);
+  }
+  return _scheduleActive;
+}
+// MARK: Read_Switches
+void Read_Switches(ulong debounceInterval, bool isActiveLow)
+{
+  if (!isTimeWithinScheduledRange(_currentUnix))
+  {
+    return;
+  }
+
+  unsigned long currentTime = millis();
+  bool pin1_activated_this_cycle = false;
+  bool pin2_activated_this_cycle = false;
+
+  bool currentReadingPin1 = digitalRead(SWITCH_PIN_1);
+  if (currentReadingPin1 != debouncingStatePin1)
+  {
+    lastDebounceTimePin1 = currentTime;
+    debouncingStatePin1 = currentReadingPin1;
+  }
+  if ((currentTime - lastDebounceTimePin1) > debounceInterval)
+  {
+    if (debouncingStatePin1 != debouncedStatePin1)
+    {
+      debouncedStatePin1 = debouncingStatePin1;
+      if (debouncedStatePin1 == (isActiveLow ? LOW : HIGH))
+      {
+        pin1_activated_this_cycle = true;
+      }
+    }
+  }
+
+  bool currentReadingPin2 = digitalRead(SWITCH_PIN_2);
+  if (currentReadingPin2 != debouncingStatePin2)
+  {
+    lastDebounceTimePin2 = currentTime;
+    debouncingStatePin2 = currentReadingPin2;
+  }
+  if ((currentTime - lastDebounceTimePin2) > debounceInterval)
+  {
+    if (debouncingStatePin2 != debouncedStatePin2)
+    {
+      debouncedStatePin2 = debouncingStatePin2;
+      if (debouncedStatePin2 == (isActiveLow ? LOW : HIGH))
+      {
+        pin2_activated_this_cycle = true;
+      }
+    }
+  }
+
+  if (pin1_activated_this_cycle || pin2_activated_this_cycle)
+  {
+    _count++;
+    History_Count();
+    Send_Event(countEvents, String(_count));
+#ifdef DEBUG
+    Serial.print("Count: " + String(_count) + " (Triggered by: ");
+    if (pin1_activated_this_cycle)
+      Serial.print("SW1 ");
     if (pin2_activated_this_cycle)
       Serial.print("SW2");
     Serial.println(")");
 #endif
   }
 }
-// MARK: RTC_Init
-void RTC_Init()
+// MARK: RTC_Init
+void RTC_Init()
+{
+  if (!rtc.begin())
+  {
+    Serial.println("Couldn't find RTC");
+    Serial.flush();
+  }
+  if (rtc.lostPower())
+  {
+    Serial.println("RTC lost power, setting the time!");
+    rtc.adjust(DateTime(F(__DATE__), F(__TIME__)));
+  }
+  rtc.disable32K();
+}
+
+DateTime RTC_getTime()
+{
+  DateTime now = rtc.now();
+  return now;
+}
+// MARK: Clock
+// Re-bases the software clock on the RTC. The base is taken at an arbitrary
+// point within the RTC's second, so the two read one second apart much of the
+// time without either being wrong. Only a difference of two seconds or more is
+// stepped, which keeps the clock within two seconds of the RTC and stops it
+// stepping back and forth, and rescheduling, on every sync.
+void Clock_Sync(bool force)
+{
+  unsigned long currentTime = millis();
+  if (!force && currentTime - _lastClockSync < clockSyncInterval)
+  {
+    return;
+  }
+  _lastClockSync = currentTime;
+
+  uint32_t rtcUnix = RTC_getTime().unixtime();
+  uint32_t softUnix = Clock_Now();
+  int32_t diff = (int32_t)(rtcUnix - softUnix);
+  if (force || diff >= 2 || diff <= -2)
+  {
+#ifdef DEBUG
+    if (!force)
+    {
+      Serial.printf("Clock: Stepping %ld s to match RTC\n", (long)diff);
+    }
+#endif
+    _clockBaseUnix = rtcUnix;
+    _clockBaseMillis = currentTime;
+    if (force || rtcUnix < softUnix)
+    {
+      // The clock went back, the precompiled transition may be in the future now
+      Schedule_Invalidate();
+    }
+  }
+}
+
+uint32_t Clock_Now()
+{
+  return _clockBaseUnix + (millis() - _clockBaseMillis) / 1000;
+}
+// MARK: SD_Init
+void SD_Init()
+{
+  // Every later access goes through the worker, even without a card
+  SD_Worker_Init();
+  if (!SD.begin()) // Pass CS pin if not default, e.g., SD.begin(SS_PIN)
+  {
+#ifdef DEBUG
+    Serial.println("Card Mount Failed");
+#endif
+    return;
+  }
+  uint8_t cardType = SD.cardType();
+  if (cardType == CARD_NONE)
+  {
+#ifdef DEBUG
+    Serial.println("No SD card attached");
+#endif
+    return;
+  }
+#ifdef DEBUG
+  Serial.print("SD Card Type: ");
+  if (cardType == CARD_MMC)
+    Serial.println("MMC");
+  else if (cardType == CARD_SD)
+    Serial.println("SDSC");
+  else if (cardType == CARD_SDHC)
+    Serial.println("SDHC");
+  else
+    Serial.println("Unknown type");
+  uint64_t cardSize = SD.cardSize() / (1024 * 1024);
+  Serial.printf("SD Card Size: %lluMB\n", cardSize);
+#endif
+}
+// MARK: SD worker
+// One task owns the card. Everybody else hands it jobs through three queues:
+// appends are always served first, web reads come in bounded chunks so they
+// interleave with appends, and background work gets a turn at least every
+// SD_IO_BURST web jobs.
+struct SdJob
+{
+  SdJobFn fn;
+  void *context;
+  ulong queuedAt;
+};
+
+struct SdQueueStats
+{
+  uint32_t completed;
+  uint32_t dropped;
+  uint16_t maxDepth;
+  ulong maxWait;
+};
+
+static QueueHandle_t _sdQueues[SD_PRIO_COUNT];
+static SemaphoreHandle_t _sdWork = NULL; // One count per queued job
+static TaskHandle_t _sdTask = NULL;
+static SdQueueStats _sdStats[SD_PRIO_COUNT];
+
+static void SD_CloseAbandoned();
+
+static void SD_Worker(void *arg)
+{
+  uint8_t ioStreak = 0;
+  for (;;)
+  {
+    xSemaphoreTake(_sdWork, portMAX_DELAY);
+    SD_CloseAbandoned();
+    SdJob job;
+    SdPriority priority;
+    if (xQueueReceive(_sdQueues[SD_PRIO_LOG], &job, 0) == pdTRUE)
+      priority = SD_PRIO_LOG;
+    else if (ioStreak >= SD_IO_BURST && xQueueReceive(_sdQueues[SD_PRIO_BACKGROUND], &job, 0) == pdTRUE)
+      priority = SD_PRIO_BACKGROUND;
+    else if (xQueueReceive(_sdQueues[SD_PRIO_IO], &job, 0) == pdTRUE)
+      priority = SD_PRIO_IO;
+    else if (xQueueReceive(_sdQueues[SD_PRIO_BACKGROUND], &job, 0) == pdTRUE)
+      priority = SD_PRIO_BACKGROUND;
+    else
+      continue;
+
+    if (priority == SD_PRIO_IO)
+      ioStreak++;
+    else if (priority == SD_PRIO_BACKGROUND)
+      ioStreak = 0;
+
+    SdQueueStats &stats = _sdStats[priority];
+    stats.maxWait = max(stats.maxWait, millis() - job.queuedAt);
+    job.fn(job.context);
+    stats.completed++;
+  }
+}
+
+void SD_Worker_Init()
+{
+  if (_sdTask != NULL)
+  {
+    return;
+  }
+  for (uint8_t i = 0; i < SD_PRIO_COUNT; i++)
+  {
+    _sdQueues[i] = xQueueCreate(SD_QUEUE_DEPTH, sizeof(SdJob));
+  }
+  _sdWork = xSemaphoreCreateCounting(SD_QUEUE_DEPTH * SD_PRIO_COUNT, 0);
+  // Same priority as loop(), on the other core
+  xTaskCreatePinnedToCore(SD_Worker, "sd", 8192, NULL, 1, &_sdTask, 0);
+}
+
+static bool SD_Enqueue(SdPriority priority, SdJobFn fn, void *context, TickType_t wait)
+{
+  SdJob job = {fn, context, millis()};
+  if (xQueueSend(_sdQueues[priority], &job, wait) != pdTRUE)
+  {
+    _sdStats[priority].dropped++;
+    return false;
+  }
+  _sdStats[priority].maxDepth = max(_sdStats[priority].maxDepth, (uint16_t)uxQueueMessagesWaiting(_sdQueues[priority]));
+  xSemaphoreGive(_sdWork);
+  return true;
+}
+
+// Queues a job and returns at once, false if its queue is full.
+// The job owns the context.
+bool SD_Submit(SdPriority priority, SdJobFn fn, void *context)
+{
+  if (_sdTask == NULL)
+  {
+    fn(context);
+    return true;
+  }
+  return SD_Enqueue(priority, fn, context, 0);
+}
+
+// A job SD_Run() is waiting for. Whoever sees it last frees it: the worker if
+// it was withdrawn before starting, the caller otherwise.
+enum SdRunState
+{
+  SD_RUN_QUEUED,
+  SD_RUN_STARTED,
+  SD_RUN_WITHDRAWN
+};
+
+struct SdRun
+{
+  SdJobFn fn;
+  void *context;
+  SemaphoreHandle_t done;
+  SdRunState state;
+};
+
+static portMUX_TYPE _sdRunMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void SD_RunJob(void *context)
+{
+  SdRun *run = (SdRun *)context;
+  portENTER_CRITICAL(&_sdRunMux);
+  bool withdrawn = run->state == SD_RUN_WITHDRAWN;
+  run->state = SD_RUN_STARTED;
+  portEXIT_CRITICAL(&_sdRunMux);
+  if (withdrawn)
+  {
+    vSemaphoreDelete(run->done);
+    delete run;
+    return;
+  }
+  run->fn(run->context);
+  xSemaphoreGive(run->done);
+}
+
+// Runs a job on the worker and waits for it, for callers that need the result.
+// The web server task must not sit behind a long archive step, so a job that
+// has not started within wait is withdrawn and false returned; the caller
+// still owns context then and should answer 503 or try again later. A job
+// that has started is always waited for, it only touches one chunk or entry.
+bool SD_Run(SdPriority priority, SdJobFn fn, void *context, TickType_t wait)
+{
+  if (_sdTask == NULL || xTaskGetCurrentTaskHandle() == _sdTask)
+  {
+    fn(context);
+    return true;
+  }
+  TickType_t start = xTaskGetTickCount();
+  SdRun *run = new SdRun{fn, context, xSemaphoreCreateBinary(), SD_RUN_QUEUED};
+  if (!SD_Enqueue(priority, SD_RunJob, run, wait))
+  {
+    vSemaphoreDelete(run->done);
+    delete run;
+    return false;
+  }
+  TickType_t elapsed = xTaskGetTickCount() - start;
+  if (xSemaphoreTake(run->done, wait == portMAX_DELAY ? portMAX_DELAY : wait - min(elapsed, wait)) != pdTRUE)
+  {
+    portENTER_CRITICAL(&_sdRunMux);
+    bool started = run->state == SD_RUN_STARTED;
+    if (!started)
+      run->state = SD_RUN_WITHDRAWN;
+    portEXIT_CRITICAL(&_sdRunMux);
+    if (!started)
+    {
+      return false;
+    }
+    xSemaphoreTake(run->done, portMAX_DELAY);
+  }
+  vSemaphoreDelete(run->done);
+  delete run;
+  return true;
+}
+
+struct SdAppendJob
+{
+  String path;
+  String data;
+};
+
+static void SD_AppendJob(void *context)
+{
+  SdAppendJob *job = (SdAppendJob *)context;
+  int slash = job->path.lastIndexOf('/');
+  if (slash > 0 && !SD.exists(job->path.substring(0, slash)))
+  {
+    SD.mkdir(job->path.substring(0, slash));
+  }
+  File file = SD.open(job->path, FILE_APPEND);
+  if (file)
+  {
+    file.print(job->data);
+    file.close();
+  }
+#ifdef DEBUG
+  else
+  {
+    Serial.println("SD: Error opening file for append: " + job->path);
+  }
+#endif
+  delete job;
+}
+
+// Appends data to a file, creating its directory if needed
+bool SD_Append(const String &path, const String &data)
+{
+  SdAppendJob *job = new SdAppendJob{path, data};
+  if (!SD_Submit(SD_PRIO_LOG, SD_AppendJob, job))
+  {
+    delete job;
+    return false;
+  }
+  return true;
+}
+
+static void SD_RemoveJob(void *context)
+{
+  String *path = (String *)context;
+  SD.remove(*path);
+  delete path;
+}
+
+// Removed in order with the appends queued before it
+bool SD_Remove(const String &path)
+{
+  String *job = new String(path);
+  if (!SD_Submit(SD_PRIO_LOG, SD_RemoveJob, job))
+  {
+    delete job;
+    return false;
+  }
+  return true;
+}
+
+struct SdRemoveNowJob
+{
+  String path;
+  bool removed;
+};
+
+static void SD_RemoveNowJob(void *context)
+{
+  SdRemoveNowJob *job = (SdRemoveNowJob *)context;
+  job->removed = SD.remove(job->path);
+}
+
+// Removes a file for the web server and reports whether it worked, busy if
+// the card did not get to it in time
+bool SD_RemoveNow(const String &path, bool &busy)
+{
+  SdRemoveNowJob job = {path, false};
+  busy = !SD_Run(SD_PRIO_IO, SD_RemoveNowJob, &job);
+  return job.removed;
+}
+
+String SD_StatusJson()
+{
+  static const char *names[SD_PRIO_COUNT] = {"log", "io", "background"};
+  JsonDocument doc;
+  for (uint8_t i = 0; i < SD_PRIO_COUNT; i++)
+  {
+    JsonObject queue = doc[names[i]].to<JsonObject>();
+    queue["depth"] = _sdTask != NULL ? uxQueueMessagesWaiting(_sdQueues[i]) : 0;
+    queue["maxDepth"] = _sdStats[i].maxDepth;
+    queue["completed"] = _sdStats[i].completed;
+    queue["dropped"] = _sdStats[i].dropped;
+    queue["maxWaitMs"] = _sdStats[i].maxWait;
+  }
+
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
+}
+// MARK: listDir
+struct SdListJob
+{
+  fs::FS *fs;
+  const char *dirname;
+  File dir;
+  bool opened;
+  bool failed;
+  bool done;
+  uint8_t count;
+  String names[SD_LIST_CHUNK];
+  bool isDirectory[SD_LIST_CHUNK];
+  SdListJob *next; // On _sdAbandoned
+};
+
+// Listings given up on with the directory open while the IO queue was full.
+// The worker closes them before its next job.
+static SdListJob *_sdAbandoned = NULL;
+static portMUX_TYPE _sdAbandonMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Reads the next SD_LIST_CHUNK entries of the directory, keeping it open in between
+static void SD_ListJob(void *context)
+{
+  SdListJob *job = (SdListJob *)context;
+  job->count = 0;
+  if (!job->opened)
+  {
+    job->opened = true;
+    job->dir = job->fs->open(job->dirname);
+    if (!job->dir || !job->dir.isDirectory())
+    {
+      job->dir.close();
+      job->failed = job->done = true;
+      return;
+    }
+  }
+  while (job->count < SD_LIST_CHUNK)
+  {
+    File file = job->dir.openNextFile();
+    if (!file)
+    {
+      job->dir.close();
+      job->done = true;
+      return;
+    }
+    job->names[job->count] = file.name(); // Just the name, e.g. "file.txt" or "subdir"
+    job->isDirectory[job->count] = file.isDirectory();
+    job->count++;
+    file.close();
+  }
+}
+
+// Closes a listing given up half way, on the worker since it owns the card
+static void SD_ListAbandonJob(void *context)
+{
+  SdListJob *job = (SdListJob *)context;
+  job->dir.close();
+  delete job;
+}
+
+static void SD_CloseAbandoned()
+{
+  portENTER_CRITICAL(&_sdAbandonMux);
+  SdListJob *job = _sdAbandoned;
+  _sdAbandoned = NULL;
+  portEXIT_CRITICAL(&_sdAbandonMux);
+  while (job != NULL)
+  {
+    SdListJob *next = job->next;
+    SD_ListAbandonJob(job);
+    job = next;
+  }
+}
+
+static bool listDirInto(fs::FS &fs, const String &dirname, uint8_t levels, JsonDocument &doc, bool &busy)
+{
+  SdListJob *job = new SdListJob();
+  job->fs = &fs;
+  job->dirname = dirname.c_str();
+  String basePath = dirname.endsWith("/") ? dirname : dirname + "/";
+
+  while (!job->done && !busy)
+  {
+    if (!SD_Run(SD_PRIO_IO, SD_ListJob, job))
+    {
+      busy = true;
+      break;
+    }
+    for (uint8_t i = 0; i < job->count; i++)
+    {
+      String fullEntryPath = basePath + job->names[i];
+      if (!job->isDirectory[i])
+      {
+        doc.add(fullEntryPath); // Add the full absolute path of the file
+      }
+      else if (levels > 0 && !listDirInto(fs, fullEntryPath, levels - 1, doc, busy))
+      {
+#ifdef DEBUG
+        Serial.printf("listDir: Error in subdirectory %s\n", fullEntryPath.c_str());
+#endif
+      }
+    }
+  }
+  bool failed = job->failed;
+  if (job->opened && !job->done)
+  {
+    // Given up with the directory open, the worker closes it and frees the
+    // job. The web server task must not wait for a queue slot to say so.
+    if (!SD_Enqueue(SD_PRIO_IO, SD_ListAbandonJob, job, 0))
+    {
+      portENTER_CRITICAL(&_sdAbandonMux);
+      job->next = _sdAbandoned;
+      _sdAbandoned = job;
+      portEXIT_CRITICAL(&_sdAbandonMux);
+      xSemaphoreGive(_sdWork); // Wakes the worker even if nothing else is queued
+    }
+  }
+  else
+  {
+    delete job;
+  }
+  return !failed && !busy;
+}
+
+String listDir(fs::FS &fs, const char *dirname, uint8_t levels, bool *busy)
+{
+  JsonDocument doc;
+  doc.to<JsonArray>();
+  bool timedOut = false;
+  bool listed = listDirInto(fs, dirname, levels, doc, timedOut);
+  if (busy != NULL)
+  {
+    *busy = timedOut;
+  }
+  if (!listed)
+  {
+#ifdef DEBUG
+    Serial.printf("Failed to open directory: %s\n", dirname);
+#endif
+    return "Failed to open directory";
+  }
+
+  String jsonOutput;
+  serializeJson(doc, jsonOutput);
+  return jsonOutput;
+}
+// MARK: Log_SD
+struct SdLogJob
+{
+  String filename;
+  String logEntry;
+};
+
+static void SD_LogJob(void *context)
+{
+  SdLogJob *job = (SdLogJob *)context;
+  bool newFile = !SD.exists(job->filename);
+  File dataFile = SD.open(job->filename, newFile ? FILE_WRITE : FILE_APPEND);
+  if (dataFile)
+  {
+    if (newFile)
+    {
+      dataFile.println("time,count,cpm,cph"); // Write header for new file
+    }
+    dataFile.println(job->logEntry);
+    dataFile.close();
+#ifdef DEBUG
+    Serial.printf("Logged to %s: %s (%s)\n", job->filename.c_str(), job->logEntry.c_str(), newFile ? "New file" : "Appended");
+#endif
+  }
+  else
+  {
+#ifdef DEBUG
+    Serial.println("Log_SD: Error opening file: " + job->filename);
+#endif
+  }
+  delete job;
+}
+
+struct LogSample
+{
+  uint32_t time; // Clock_Now()
+  uint32_t count;
+  float cpm; // Rounded to the 2 decimals written
+  float cph;
+};
+
+static bool Log_Write(const LogSample &sample, TickType_t wait = 0)
+{
+  DateTime time(sample.time);
+  String filename = "/";                                // Logs are stored in the root
+  filename += time.timestamp(DateTime::TIMESTAMP_DATE); // e.g., YYYY-MM-DD, of the sample, not of now
+  filename += ".csv";
+
+  String logEntry = time.timestamp(DateTime::TIMESTAMP_FULL); // Full timestamp e.g., YYYY-MM-DDTHH:MM:SS
+  logEntry += ",";
+  logEntry += String(sample.count);
+  logEntry += ",";
+  logEntry += String(sample.cpm, 2);
+  logEntry += ",";
+  logEntry += String(sample.cph, 2);
+
+  // The worker writes it, loop() only waits for a free queue slot
+  SdLogJob *job = new SdLogJob{filename, logEntry};
+  if (!(wait == 0 || _sdTask == NULL ? SD_Submit(SD_PRIO_LOG, SD_LogJob, job) : SD_Enqueue(SD_PRIO_LOG, SD_LogJob, job, wait)))
+  {
+    delete job;
+    return false;
+  }
+  _lastLogCount = sample.count;
+  return true;
+}
+
+// MARK: Log_Deadband
+// Swinging-door compression. Samples are taken every log interval, but a row
+// is only written where a straight line from the previous row could no longer
+// pass within the band of every sample since. Each column keeps the range of
+// slopes from the last row (the two doors) that still satisfies all of them:
+// a sample whose own slope is outside the range closes the segment, the
+// sample before it becomes the next row, and the doors open again from there.
+//
+// Guarantee: interpolating linearly between consecutive rows reproduces every
+// sample to within logCountBand for count, logRateBand for cpm and
+// 60 * logRateBand for cph, and rows are exact samples. While anything
+// changes, rows are at most logMaxGap plus one log interval apart. Samples
+// not written yet are lost on a restart.
+static bool _logHasRow = false;     // _logRow is the last row written today
+static bool _logHasHeld = false;    // _logHeld is the newest sample that fits the doors
+static bool _logHasPending = false; // _logPending could not be taken yet, the log queue was full
+static LogSample _logRow;
+static LogSample _logHeld;
+static LogSample _logPending;
+static float _logLow[3];
+static float _logHigh[3];
+static unsigned long _lastLogSample = 0;
+static volatile bool _logRestart = false;
+
+static float logValue(const LogSample &sample, uint8_t column)
+{
+  return column == 0 ? sample.count : column == 1 ? sample.cpm : sample.cph;
+}
+
+static bool sameLogValues(const LogSample &a, const LogSample &b)
+{
+  return a.count == b.count && a.cpm == b.cpm && a.cph == b.cph;
+}
+
+static void Log_OpenDoors()
+{
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    _logLow[i] = -INFINITY;
+    _logHigh[i] = INFINITY;
+  }
+  _logHasHeld = false;
+}
+
+// loop() waits for a slot rather than lose a row here: the worker serves the
+// log queue before anything else, so one frees up as soon as its job ends.
+static void Log_FlushHeld()
+{
+  if (_logHasRow && _logHasHeld && !sameLogValues(_logHeld, _logRow))
+  {
+    Log_Write(_logHeld, portMAX_DELAY);
+  }
+  _logHasRow = false;
+  _logHasHeld = false;
+}
+
+// Returns false if a row could not be queued. Nothing has changed then, and
+// the same sample is to be offered again.
+static bool Log_Deadband(const LogSample &sample)
+{
+  if (_logHasRow && sample.time < _logRow.time)
+  {
+    // The clock was set back, start over from here
+    Log_FlushHeld();
+  }
+  else if (_logHasRow && sample.time <= (_logHasHeld ? _logHeld.time : _logRow.time))
+  {
+    return true; // Same second as the previous sample
+  }
+  if (!_logHasRow)
+  {
+    if (!Log_Write(sample))
+    {
+      return false;
+    }
+    _logRow = sample;
+    _logHasRow = true;
+    Log_OpenDoors();
+    return true;
+  }
+
+  const float band[3] = {(float)config.logCountBand, config.logRateBand, config.logRateBand * 60};
+  float dt = sample.time - _logRow.time;
+  bool fits = true;
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    float slope = (logValue(sample, i) - logValue(_logRow, i)) / dt;
+    if (slope < _logLow[i] || slope > _logHigh[i])
+      fits = false;
+  }
+  if (_logHasHeld && sample.time - _logRow.time > config.logMaxGap && !sameLogValues(_logHeld, _logRow))
+  {
+    fits = false;
+  }
+  if (!fits)
+  {
+    // Only ever false with a held sample, the doors are wide open right after a row
+    if (!Log_Write(_logHeld))
+    {
+      return false; // Queue full, the doors and held sample are untouched for the retry
+    }
+    _logRow = _logHeld;
+    Log_OpenDoors();
+    dt = sample.time - _logRow.time;
+  }
+
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    float delta = logValue(sample, i) - logValue(_logRow, i);
+    _logLow[i] = max(_logLow[i], (delta - band[i]) / dt);
+    _logHigh[i] = min(_logHigh[i], (delta + band[i]) / dt);
+  }
+  _logHeld = sample;
+  _logHasHeld = true;
+  return true;
+}
+
+// Writes the sample the deadband is holding back, and one still waiting for
+// the queue, and starts the next row afresh. Called at midnight, before the
+// closed day is archived.
+void Log_Flush()
+{
+  Log_FlushHeld();
+  if (_logHasPending)
+  {
+    Log_Write(_logPending, portMAX_DELAY);
+    _logHasPending = false;
+  }
+}
+
+// Log settings changed, called from the web server task
+void Log_Restart()
+{
+  _logRestart = true;
+}
+
+void Log_SD(ulong interval)
+{
+  unsigned long currentTime = millis();
+  if (SD.cardType() == CARD_NONE)
+  {
+    return;
+  }
+  if (_logRestart)
+  {
+    _logRestart = false;
+    Log_Flush();
+  }
+  if (config.logMode == LOG_MODE_DEADBAND)
+  {
+    // A sample the queue had no room for is offered again on every pass,
+    // and no new one is taken until it is in
+    if (_logHasPending || currentTime - _lastLogSample > interval)
+    {
+      if (!_logHasPending)
+      {
+        _logPending = {Clock_Now(), _count, roundf(_runningAverageCPM * 100) / 100, roundf(_runningAverageCPH * 100) / 100};
+      }
+      _logHasPending = !Log_Deadband(_logPending);
+      if (!_logHasPending)
+      {
+        _lastLogSample = currentTime;
+      }
+    }
+    return;
+  }
+  if (currentTime - _lastLogTime > interval && _count != _lastLogCount)
+  {
+    LogSample sample = {Clock_Now(), _count, (float)_runningAverageCPM, (float)_runningAverageCPH};
+    if (Log_Write(sample))
+    {
+      _lastLogTime = currentTime;
+    }
+  }
+}
+// MARK: Data_Handler
+struct SdStatJob
+{
+  String path;
+  bool allowArchive; // Fall back to the archived .gz of a closed day
+  bool found;
+  bool gzip;
+  size_t size;
+};
+
+static void SD_StatJob(void *context)
+{
+  SdStatJob *job = (SdStatJob *)context;
+  job->found = job->gzip = false;
+  File file = SD.open(job->path, FILE_READ);
+  if (!file || file.isDirectory())
+  {
+    file.close();
+    if (!job->allowArchive || !job->path.endsWith(".csv"))
+      return;
+    file = SD.open(ARCHIVE_DIR + job->path + ".gz", FILE_READ);
+    if (!file)
+      return;
+    job->gzip = true;
+  }
+  job->found = true;
+  job->size = file.size();
+  file.close();
+}
+
+struct SdReadJob
+{
+  const char *path;
+  size_t offset;
+  uint8_t *buffer;
+  size_t length;
+  size_t result;
+};
+
+static void SD_ReadJob(void *context)
+{
+  SdReadJob *job = (SdReadJob *)context;
+  job->result = 0;
+  File file = SD.open(job->path, FILE_READ);
+  if (file && file.seek(job->offset))
+  {
+    job->result = file.read(job->buffer, job->length);
+  }
+  file.close();
+}
+
+static const char *contentTypeFor(const String &path)
+{
+  if (path.endsWith(".csv"))
+    return "text/csv";
+  if (path.endsWith(".gz"))
+    return "application/gzip";
+  if (path.endsWith(".json") || path.endsWith(".jsonl"))
+    return "application/json";
+  if (path.endsWith(".bin"))
+    return "application/octet-stream";
+  return "text/plain";
+}
+
+// Serves files from the SD card under /data, one SD_READ_CHUNK job at a time.
+// A closed day that has been archived is served from its .gz with
+// Content-Encoding: gzip, so the same /data/<date>.csv URL keeps working and
+// downloads are much smaller.
+void Data_Handler(AsyncWebServerRequest *request)
+{
+  String path = request->url().substring(5); // Strip "/data"
+  if (path == "" || path.indexOf("..") != -1)
+  {
+    request->send(404, "text/plain", "Not found");
+    return;
+  }
+
+  SdStatJob stat = {path, true, false, false, 0};
+  if (!SD_Run(SD_PRIO_IO, SD_StatJob, &stat))
+  {
+    request->send(503, "text/plain", "SD card busy, try again");
+    return;
+  }
+  if (!stat.found)
+  {
+    request->send(404, "text/plain", "Not found");
+    return;
+  }
+
+  String source = stat.gzip ? ARCHIVE_DIR + path + ".gz" : path;
+  AsyncWebServerResponse *response = request->beginResponse(contentTypeFor(path), stat.size, [source](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                                            {
+    SdReadJob read = {source.c_str(), index, buffer, min(maxLen, (size_t)SD_READ_CHUNK), 0};
+    if (!SD_Run(SD_PRIO_IO, SD_ReadJob, &read))
+      return RESPONSE_TRY_AGAIN; // Asked again for the same index once the connection is polled
+    return read.result; });
+  if (stat.gzip)
+  {
+    response->addHeader("Content-Encoding", "gzip");
+    response->addHeader("Cache-Control", "max-age=86400"); // Archived days no longer change
+  }
+  else
+  {
+    response->addHeader("Cache-Control", "max-age=60");
+  }
+  request->send(response);
+}
+// MARK: Series
+// GET /api/series?date=YYYY-MM-DD&from=HH:MM&to=HH:MM&points=N
+// One pass over the day's log, or its archive, splitting [from, to) into N/4
+// equal time buckets and keeping the first, last, lowest-cpm and highest-cpm
+// row of each (M4 downsampling). Spikes and stoppages survive, the reply never
+// has more than N points, and memory is one bucket plus one read chunk
+// whatever the range.
+// The scan runs on the SD worker, SERIES_READS_PER_JOB reads per job, and
+// feeds the reply through a stream buffer. The web server task only drains
+// it, so a long or sparse range never holds async_tcp on the card.
+struct SeriesRow
+{
+  uint32_t time; // Seconds after midnight
+  uint32_t count;
+  float cpm;
+  float cph;
+};
+
+struct SeriesQuery
+{
+  String source;
+  bool gzip;
+  uint32_t dayStart; // Unix time of midnight
+  uint32_t from;     // Seconds after midnight, to is exclusive
+  uint32_t to;
+  uint32_t bucketWidth;
+  uint8_t stage; // 0 header, 1 rows, 2 trailer, 3 done
+  bool seek;     // Bisect to from before the first row
+
+  size_t offset; // Next byte to read from the file
+  size_t size;
+  bool eof;      // Nothing more to parse
+  uint8_t reads; // In the current job
+  uint8_t buf[SD_READ_CHUNK];
+  const uint8_t *text; // CSV not parsed yet
+  size_t textLen;
+  size_t zLen; // Compressed bytes in buf, archives only
+  size_t zPos;
+  tinfl_decompressor *inflator;
+  uint8_t *dict; // TINFL_LZ_DICT_SIZE bytes, wraps around
+  size_t dictPos;
+  bool inflateDone;
+  char line[64];
+  uint8_t lineLen;
+
+  bool bucketUsed;
+  uint32_t bucket;
+  SeriesRow first, low, high, last;
+  uint32_t rows;   // Rows in range
+  uint32_t points; // Rows sent
+
+  char out[512]; // Produced, not yet in the stream
+  size_t outLen;
+
+  StreamBufferHandle_t stream; // Worker writes, web server task reads
+  volatile bool finished;      // Everything is in the stream
+  bool queued;                 // A job holds a reference, under _seriesMux
+};
+
+static uint8_t _seriesQueries = 0; // Under _seriesMux, a query may be freed by either task
+static portMUX_TYPE _seriesMux = portMUX_INITIALIZER_UNLOCKED;
+
+static bool Series_ParseLine(const char *line, SeriesRow &row)
+{
+  // 2025-05-16T08:00:00,123,3.50,210.00
+  int hour, minute, second;
+  unsigned long count;
+  if (sscanf(line, "%*10cT%d:%d:%d,%lu,%f,%f", &hour, &minute, &second, &count, &row.cpm, &row.cph) != 6)
+  {
+    return false;
+  }
+  row.time = hour * 3600 + minute * 60 + second;
+  row.count = count;
+  return true;
+}
+
+// Plain logs are sorted by time, so the first row of the range is found by
+// bisecting on the card instead of reading everything before it.
+static void Series_Seek(SeriesQuery &q)
+{
+  size_t lo = 0, hi = q.size;
+  while (hi - lo > SD_READ_CHUNK)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    SdReadJob read = {q.source.c_str(), mid, q.buf, sizeof(q.line) * 2, 0};
+    SD_ReadJob(&read);
+    // First whole line after mid
+    const uint8_t *newline = (const uint8_t *)memchr(q.buf, '\n', read.result);
+    size_t start = newline != NULL ? newline + 1 - q.buf : read.result;
+    size_t length = min(read.result - start, sizeof(q.line) - 1);
+    memcpy(q.line, q.buf + start, length);
+    q.line[length] = '\0';
+    SeriesRow row;
+    if (newline == NULL || !Series_ParseLine(q.line, row) || row.time >= q.from)
+      hi = mid;
+    else
+      lo = mid;
+  }
+  q.offset = lo;
+  // Mid-line unless at the very start, the partial line fails to parse and is skipped
+}
+
+// Gets the next piece of CSV text, inflating it first for an archived day.
+// Runs on the worker. Returns false once the file is used up.
+static bool Series_Fill(SeriesQuery &q)
+{
+  if (!q.gzip)
+  {
+    SdReadJob read = {q.source.c_str(), q.offset, q.buf, sizeof(q.buf), 0};
+    SD_ReadJob(&read);
+    q.reads++;
+    q.offset += read.result;
+    q.text = q.buf;
+    q.textLen = read.result;
+    return read.result > 0;
+  }
+
+  while (!q.inflateDone)
+  {
+    if (q.zPos == q.zLen && q.offset < q.size)
+    {
+      SdReadJob read = {q.source.c_str(), q.offset, q.buf, sizeof(q.buf), 0};
+      SD_ReadJob(&read);
+      q.reads++;
+      if (read.result == 0)
+      {
+        return false;
+      }
+      // Archives are written by Gzip_Begin(), always a plain 10-byte header
+      q.zPos = q.offset == 0 ? min((size_t)10, read.result) : 0;
+      q.zLen = read.result;
+      q.offset += read.result;
+    }
+    size_t inBytes = q.zLen - q.zPos;
+    size_t outBytes = TINFL_LZ_DICT_SIZE - q.dictPos;
+    tinfl_status status = tinfl_decompress(q.inflator, q.buf + q.zPos, &inBytes, q.dict, q.dict + q.dictPos, &outBytes,
+                                           q.offset < q.size ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+    q.zPos += inBytes;
+    q.text = q.dict + q.dictPos;
+    q.textLen = outBytes;
+    q.dictPos = (q.dictPos + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+    q.inflateDone = status <= TINFL_STATUS_DONE;
+    if (outBytes > 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void Series_EmitRow(SeriesQuery &q, const SeriesRow &row)
+{
+  int n = snprintf(q.out + q.outLen, sizeof(q.out) - q.outLen, "%s[%lu,%lu,%.2f,%.2f]", q.points > 0 ? "," : "",
+                   (unsigned long)(q.dayStart + row.time), (unsigned long)row.count, row.cpm, row.cph);
+  q.outLen = min(q.outLen + max(n, 0), sizeof(q.out) - 1);
+  q.points++;
+}
+
+static void Series_FlushBucket(SeriesQuery &q)
+{
+  if (!q.bucketUsed)
+  {
+    return;
+  }
+  // In time order, without repeating a row that is both e.g. first and lowest
+  const SeriesRow *rows[4] = {&q.first, &q.low, &q.high, &q.last};
+  if (q.high.time < q.low.time)
+  {
+    rows[1] = &q.high;
+    rows[2] = &q.low;
+  }
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    if (i == 0 || rows[i]->time != rows[i - 1]->time)
+    {
+      Series_EmitRow(q, *rows[i]);
+    }
+  }
+  q.bucketUsed = false;
+}
+
+static void Series_AddLine(SeriesQuery &q)
+{
+  SeriesRow row;
+  q.line[q.lineLen] = '\0';
+  q.lineLen = 0;
+  if (!Series_ParseLine(q.line, row) || row.time < q.from)
+  {
+    return; // Header, partial line after a seek, or before the range
+  }
+  if (row.time >= q.to)
+  {
+    q.eof = true;
+    q.textLen = 0;
+    return;
+  }
+  q.rows++;
+  uint32_t bucket = (row.time - q.from) / q.bucketWidth;
+  if (q.bucketUsed && bucket != q.bucket)
+  {
+    Series_FlushBucket(q);
+  }
+  if (!q.bucketUsed)
+  {
+    q.bucketUsed = true;
+    q.bucket = bucket;
+    q.first = q.low = q.high = row;
+  }
+  if (row.cpm < q.low.cpm)
+    q.low = row;
+  if (row.cpm > q.high.cpm)
+    q.high = row;
+  q.last = row;
+}
+
+// Fills q.out with the next part of the reply. Rows are parsed until at least
+// one bucket has closed, the file ends or the job has used its reads; q.out
+// is left empty then and the next job carries on from the same place.
+static void Series_Produce(SeriesQuery &q)
+{
+  q.outLen = 0;
+  if (q.stage == 0)
+  {
+    String date = DateTime(q.dayStart).timestamp(DateTime::TIMESTAMP_DATE);
+    q.outLen = snprintf(q.out, sizeof(q.out),
+                        "{\"date\":\"%s\",\"from\":%lu,\"to\":%lu,\"bucket\":%lu,\"fields\":[\"time\",\"count\",\"cpm\",\"cph\"],\"points\":[",
+                        date.c_str(), (unsigned long)(q.dayStart + q.from), (unsigned long)(q.dayStart + q.to), (unsigned long)q.bucketWidth);
+    q.stage = 1;
+    return;
+  }
+  if (q.stage == 2)
+  {
+    q.outLen = snprintf(q.out, sizeof(q.out), "],\"rows\":%lu}", (unsigned long)q.rows);
+    q.stage = 3;
+    return;
+  }
+
+  // Room for a whole bucket before every line
+  while (q.stage == 1 && q.outLen == 0)
+  {
+    while (q.textLen > 0 && sizeof(q.out) - q.outLen > 4 * 48)
+    {
+      char c = *q.text++;
+      q.textLen--;
+      if (c == '\n')
+        Series_AddLine(q);
+      else if (c != '\r' && q.lineLen < sizeof(q.line) - 1)
+        q.line[q.lineLen++] = c;
+    }
+    if (q.outLen > 0 || (q.textLen == 0 && !q.eof && q.reads >= SERIES_READS_PER_JOB))
+    {
+      return;
+    }
+    if (q.eof || !Series_Fill(q))
+    {
+      if (!q.eof && q.lineLen > 0)
+      {
+        Series_AddLine(q); // Last line without a newline
+      }
+      Series_FlushBucket(q);
+      q.eof = true;
+      q.stage = 2;
+      if (q.outLen == 0)
+      {
+        Series_Produce(q);
+      }
+    }
+  }
+}
+
+static void Series_Free(SeriesQuery *q)
+{
+  free(q->inflator);
+  free(q->dict);
+  if (q->stream != NULL)
+    vStreamBufferDelete(q->stream);
+  delete q;
+  portENTER_CRITICAL(&_seriesMux);
+  _seriesQueries--;
+  portEXIT_CRITICAL(&_seriesMux);
+}
+
+static void Series_Kick(const std::shared_ptr<SeriesQuery> &query);
+
+static void Series_Job(void *context)
+{
+  std::shared_ptr<SeriesQuery> *ref = (std::shared_ptr<SeriesQuery> *)context;
+  SeriesQuery &q = **ref;
+  // The only reference left means the client has gone away
+  bool wanted = ref->use_count() > 1;
+  if (wanted)
+  {
+    if (q.seek)
+    {
+      Series_Seek(q);
+      q.seek = false;
+    }
+    q.reads = 0;
+    while (q.stage != 3 && xStreamBufferSpacesAvailable(q.stream) >= sizeof(q.out))
+    {
+      Series_Produce(q);
+      if (q.outLen == 0)
+        break; // Out of reads for this job
+      xStreamBufferSend(q.stream, q.out, q.outLen, 0);
+    }
+    q.finished = q.stage == 3;
+  }
+  portENTER_CRITICAL(&_seriesMux);
+  q.queued = false;
+  portEXIT_CRITICAL(&_seriesMux);
+  // Out of reads, or the client drained the stream meanwhile: carry on
+  // behind whatever else is waiting for the card
+  if (wanted && xStreamBufferSpacesAvailable(q.stream) >= sizeof(q.out))
+  {
+    Series_Kick(*ref);
+  }
+  delete ref;
+}
+
+// Queues the next scan job unless one is already queued or the scan is done.
+// A full queue is harmless, the reply filler kicks again when polled.
+static void Series_Kick(const std::shared_ptr<SeriesQuery> &query)
+{
+  SeriesQuery &q = *query;
+  portENTER_CRITICAL(&_seriesMux);
+  bool start = !q.queued && !q.finished;
+  q.queued = q.queued || start;
+  portEXIT_CRITICAL(&_seriesMux);
+  if (!start)
+  {
+    return;
+  }
+  std::shared_ptr<SeriesQuery> *ref = new std::shared_ptr<SeriesQuery>(query);
+  if (!SD_Submit(SD_PRIO_IO, Series_Job, ref))
+  {
+    delete ref;
+    portENTER_CRITICAL(&_seriesMux);
+    q.queued = false;
+    portEXIT_CRITICAL(&_seriesMux);
+  }
+}
+
+void Series_Handler(AsyncWebServerRequest *request)
+{
+  String date = request->hasParam("date") ? request->getParam("date")->value() : "";
+  long days = parseDateDays(date.c_str());
+  if (days < 0)
+  {
+    request->send(400, "text/plain", "Bad Request: date must be YYYY-MM-DD");
+    return;
+  }
+  int from = request->hasParam("from") ? parseClockMinutes(request->getParam("from")->value().c_str()) : 0;
+  int to = 24 * 60;
+  if (request->hasParam("to") && request->getParam("to")->value() != "24:00")
+  {
+    to = parseClockMinutes(request->getParam("to")->value().c_str());
+  }
+  long points = request->hasParam("points") ? request->getParam("points")->value().toInt() : SERIES_DEFAULT_POINTS;
+  if (from < 0 || to <= from)
+  {
+    request->send(400, "text/plain", "Bad Request: from and to must be HH:MM with from before to");
+    return;
+  }
+  points = constrain(points, SERIES_MIN_POINTS, SERIES_MAX_POINTS);
+  portENTER_CRITICAL(&_seriesMux);
+  uint8_t queries = _seriesQueries;
+  portEXIT_CRITICAL(&_seriesMux);
+  if (queries >= SERIES_MAX_QUERIES)
+  {
+    request->send(503, "text/plain", "Busy, try again");
+    return;
+  }
+
+  DateTime dayStart((uint32_t)days * 86400UL);
+  SdStatJob stat = {"/" + dayStart.timestamp(DateTime::TIMESTAMP_DATE) + ".csv", true, false, false, 0};
+  if (!SD_Run(SD_PRIO_IO, SD_StatJob, &stat))
+  {
+    request->send(503, "text/plain", "SD card busy, try again");
+    return;
+  }
+  if (!stat.found)
+  {
+    request->send(404, "text/plain", "Not found");
+    return;
+  }
+
+  SeriesQuery *q = new (std::nothrow) SeriesQuery();
+  if (q == NULL)
+  {
+    request->send(503, "text/plain", "Out of memory");
+    return;
+  }
+  portENTER_CRITICAL(&_seriesMux);
+  _seriesQueries++;
+  portEXIT_CRITICAL(&_seriesMux);
+  q->gzip = stat.gzip;
+  q->source = stat.gzip ? ARCHIVE_DIR + stat.path + ".gz" : stat.path;
+  q->size = stat.size;
+  q->dayStart = dayStart.unixtime();
+  q->from = from * 60;
+  q->to = to * 60;
+  // Four points per bucket
+  uint32_t buckets = points / 4;
+  q->bucketWidth = (q->to - q->from + buckets - 1) / buckets;
+  q->seek = !q->gzip && q->from > 0;
+  q->stream = xStreamBufferCreate(SERIES_STREAM_BYTES, 1);
+  if (q->gzip)
+  {
+    q->inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    q->dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (q->inflator != NULL)
+      tinfl_init(q->inflator);
+  }
+  if (q->stream == NULL || (q->gzip && (q->inflator == NULL || q->dict == NULL)))
+  {
+    Series_Free(q);
+    request->send(503, "text/plain", "Out of memory");
+    return;
+  }
+
+  // Freed by whichever of the response and a queued job lets go last
+  std::shared_ptr<SeriesQuery> query(q, Series_Free);
+  Series_Kick(query);
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [query](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                                                   {
+    // finished is read first, it is only set once the last bytes are in the stream
+    bool finished = query->finished;
+    size_t n = xStreamBufferReceive(query->stream, buffer, maxLen, 0);
+    if (n == 0 && finished)
+      return 0;
+    Series_Kick(query); // There is room again
+    return n > 0 ? n : RESPONSE_TRY_AGAIN; });
+  response->addHeader("Cache-Control", stat.gzip ? "max-age=86400" : "max-age=60");
+  request->send(response);
+}
+// MARK: Gzip
+// Minimal streaming gzip writer: LZ77 over a 4 KB window with short hash
+// chains and the fixed Huffman code, all in one deflate block. About 24 KB of
+// heap while open, which is plenty for CSV logs made of repeated timestamps.
+#define GZ_WINDOW 4096
+#define GZ_HASH_SIZE 4096
+#define GZ_NIL 0xFFFF
+#define GZ_MIN_MATCH 3
+#define GZ_MAX_MATCH 258
+#define GZ_MAX_CHAIN 16
+
+struct GzipWriter
+{
+  File out;
+  uint8_t *window; // 2 * GZ_WINDOW bytes, slides down by GZ_WINDOW
+  uint16_t *head;  // Latest position for each hash
+  uint16_t *prev;  // Previous position with the same hash
+  uint32_t length; // Bytes in window
+  uint32_t pos;    // Next byte to encode
+  uint32_t bitBuf;
+  uint8_t bitCount;
+  uint32_t crc;
+  uint32_t inSize;
+  uint32_t outSize;
+  uint8_t outBuf[256];
+  uint16_t outLen;
+  bool failed; // A write to the output came up short
+};
+
+static const uint16_t gzLengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t gzLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t gzDistBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t gzDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t len)
+{
+  static const uint32_t table[16] = {0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+                                     0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+    crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+static void gzFlushOut(GzipWriter &gz)
+{
+  if (gz.outLen > 0)
+  {
+    if (gz.out.write(gz.outBuf, gz.outLen) != gz.outLen)
+      gz.failed = true;
+    gz.outSize += gz.outLen;
+    gz.outLen = 0;
+  }
+}
+
+static void gzPutByte(GzipWriter &gz, uint8_t value)
+{
+  gz.outBuf[gz.outLen++] = value;
+  if (gz.outLen == sizeof(gz.outBuf))
+  {
+    gzFlushOut(gz);
+  }
+}
+
+static void gzPutBits(GzipWriter &gz, uint32_t value, uint8_t count)
+{
+  gz.bitBuf |= value << gz.bitCount;
+  gz.bitCount += count;
+  while (gz.bitCount >= 8)
+  {
+    gzPutByte(gz, gz.bitBuf & 0xFF);
+    gz.bitBuf >>= 8;
+    gz.bitCount -= 8;
+  }
+}
+
+// Huffman codes are defined MSB first, the bit stream is LSB first
+static void gzPutCode(GzipWriter &gz, uint16_t code, uint8_t count)
+{
+  uint16_t reversed = 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  gzPutBits(gz, reversed, count);
+}
+
+static void gzPutSymbol(GzipWriter &gz, uint16_t symbol)
+{
+  if (symbol < 144)
+    gzPutCode(gz, 0x30 + symbol, 8);
+  else if (symbol < 256)
+    gzPutCode(gz, 0x190 + symbol - 144, 9);
+  else if (symbol < 280)
+    gzPutCode(gz, symbol - 256, 7);
+  else
+    gzPutCode(gz, 0xC0 + symbol - 280, 8);
+}
+
+static void gzPutMatch(GzipWriter &gz, uint16_t length, uint16_t distance)
+{
+  int8_t i = 28;
+  while (length < gzLengthBase[i])
+    i--;
+  gzPutSymbol(gz, 257 + i);
+  gzPutBits(gz, length - gzLengthBase[i], gzLengthExtra[i]);
+
+  i = 29;
+  while (distance < gzDistBase[i])
+    i--;
+  gzPutCode(gz, i, 5);
+  gzPutBits(gz, distance - gzDistBase[i], gzDistExtra[i]);
+}
+
+static uint16_t gzHash(const uint8_t *p)
+{
+  return (((uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2]) * 2654435761u) >> 20; // 12 bits
+}
+
+static void gzInsert(GzipWriter &gz, uint32_t at)
+{
+  if (at + GZ_MIN_MATCH <= gz.length)
+  {
+    uint16_t h = gzHash(gz.window + at);
+    gz.prev[at & (GZ_WINDOW - 1)] = gz.head[h];
+    gz.head[h] = at;
+  }
+}
+
+// Encodes what is in the window, keeping a full match length of lookahead
+// unless this is the end of the input
+static void gzCompress(GzipWriter &gz, bool final)
+{
+  while (final ? gz.pos < gz.length : gz.pos + GZ_MAX_MATCH <= gz.length)
+  {
+    uint16_t bestLength = 0;
+    uint16_t bestDistance = 0;
+    uint32_t maxLength = min((uint32_t)GZ_MAX_MATCH, gz.length - gz.pos);
+    if (maxLength >= GZ_MIN_MATCH)
+    {
+      uint16_t candidate = gz.head[gzHash(gz.window + gz.pos)];
+      for (uint8_t chain = 0; chain < GZ_MAX_CHAIN && candidate != GZ_NIL && candidate < gz.pos; chain++)
+      {
+        uint32_t matched = 0;
+        while (matched < maxLength && gz.window[candidate + matched] == gz.window[gz.pos + matched])
+          matched++;
+        if (matched > bestLength)
+        {
+          bestLength = matched;
+          bestDistance = gz.pos - candidate;
+          if (matched == maxLength)
+            break;
+        }
+        candidate = gz.prev[candidate & (GZ_WINDOW - 1)];
+      }
+    }
+
+    if (bestLength >= GZ_MIN_MATCH)
+    {
+      gzPutMatch(gz, bestLength, bestDistance);
+      for (uint16_t i = 0; i < bestLength; i++)
+        gzInsert(gz, gz.pos + i);
+      gz.pos += bestLength;
+    }
+    else
+    {
+      gzPutSymbol(gz, gz.window[gz.pos]);
+      gzInsert(gz, gz.pos);
+      gz.pos++;
+    }
+  }
+}
+
+static void gzSlide(GzipWriter &gz)
+{
+  memmove(gz.window, gz.window + GZ_WINDOW, gz.length - GZ_WINDOW);
+  gz.length -= GZ_WINDOW;
+  gz.pos -= GZ_WINDOW;
+  for (uint16_t i = 0; i < GZ_HASH_SIZE; i++)
+    gz.head[i] = (gz.head[i] == GZ_NIL || gz.head[i] < GZ_WINDOW) ? GZ_NIL : gz.head[i] - GZ_WINDOW;
+  for (uint16_t i = 0; i < GZ_WINDOW; i++)
+    gz.prev[i] = (gz.prev[i] == GZ_NIL || gz.prev[i] < GZ_WINDOW) ? GZ_NIL : gz.prev[i] - GZ_WINDOW;
+}
+
+static bool Gzip_Begin(GzipWriter &gz, File out)
+{
+  gz.window = (uint8_t *)malloc(2 * GZ_WINDOW);
+  gz.head = (uint16_t *)malloc(GZ_HASH_SIZE * sizeof(uint16_t));
+  gz.prev = (uint16_t *)malloc(GZ_WINDOW * sizeof(uint16_t));
+  if (!gz.window || !gz.head || !gz.prev)
+  {
+    free(gz.window);
+    free(gz.head);
+    free(gz.prev);
+    gz.window = NULL;
+    gz.head = gz.prev = NULL;
+    return false;
+  }
+  memset(gz.head, 0xFF, GZ_HASH_SIZE * sizeof(uint16_t));
+  memset(gz.prev, 0xFF, GZ_WINDOW * sizeof(uint16_t));
+  gz.out = out;
+  gz.length = gz.pos = 0;
+  gz.bitBuf = gz.bitCount = 0;
+  gz.crc = 0;
+  gz.inSize = gz.outSize = 0;
+  gz.outLen = 0;
+  gz.failed = false;
+
+  static const uint8_t header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF}; // Deflate, no name, unknown OS
+  for (uint8_t b : header)
+    gzPutByte(gz, b);
+  gzPutBits(gz, 1, 1); // Last block
+  gzPutBits(gz, 1, 2); // Fixed Huffman codes
+  return true;
+}
+
+static void Gzip_Write(GzipWriter &gz, const uint8_t *data, size_t len)
+{
+  gz.crc = crc32Update(gz.crc, data, len);
+  gz.inSize += len;
+  while (len > 0)
+  {
+    if (gz.length == 2 * GZ_WINDOW)
+    {
+      gzSlide(gz);
+    }
+    size_t n = min(len, (size_t)(2 * GZ_WINDOW - gz.length));
+    memcpy(gz.window + gz.length, data, n);
+    gz.length += n;
+    data += n;
+    len -= n;
+    gzCompress(gz, false);
+  }
+}
+
+static void Gzip_End(GzipWriter &gz)
+{
+  gzCompress(gz, true);
+  gzPutSymbol(gz, 256); // End of block
+  if (gz.bitCount > 0)
+    gzPutBits(gz, 0, 8 - gz.bitCount);
+  for (uint8_t i = 0; i < 4; i++)
+    gzPutByte(gz, gz.crc >> (8 * i));
+  for (uint8_t i = 0; i < 4; i++)
+    gzPutByte(gz, gz.inSize >> (8 * i));
+  gzFlushOut(gz);
+  free(gz.window);
+  free(gz.head);
+  free(gz.prev);
+  gz.window = NULL;
+  gz.head = gz.prev = NULL;
+}
+// MARK: Archive
+// After a day rollover each closed <date>.csv in the card root is compressed
+// into ARCHIVE_DIR one chunk per step, summarised into ARCHIVE_SUMMARY_FILE and
+// removed. Old archives are then pruned by age and free space. Every step
+// runs as a background job on the SD worker.
+enum ArchiveState
+{
+  ARCHIVE_IDLE,
+  ARCHIVE_COMPRESS,
+  ARCHIVE_RETENTION
+};
+
+static volatile ArchiveState _archiveState = ARCHIVE_IDLE;
+static volatile bool _archivePending = false;
+static volatile bool _archiveJobQueued = false;
+static ulong _lastArchiveStep = 0;
+static GzipWriter _archiveGzip;
+static File _archiveInput;
+static String _archiveSource; // e.g. "/2025-05-16.csv"
+static String _archiveTarget; // e.g. "/archive/2025-05-16.csv.gz"
+static DaySummary _archiveSummary;
+static char _archiveLine[64];
+static uint8_t _archiveLineLen = 0;
+// SD.usedBytes() walks the whole FAT, so it is read once per retention pass
+// and adjusted for the archives removed; -1 until then
+static int64_t _archiveFreeBytes = -1;
+
+// Matches "YYYY-MM-DD<suffix>" and returns the day number
+static bool parseDayName(const char *name, const char *suffix, uint32_t &day)
+{
+  int year, month, date;
+  if (strlen(name) != 10 + strlen(suffix) || strcmp(name + 10, suffix) != 0 ||
+      sscanf(name, "%4d-%2d-%2d", &year, &month, &date) != 3)
+  {
+    return false;
+  }
+  day = DateTime(year, month, date).unixtime() / 86400;
+  return true;
+}
+
+// Oldest file in dirname named after a day, optionally only days before today
+static bool findOldestDayFile(const char *dirname, const char *suffix, bool closedOnly, String &path, uint32_t &oldest)
+{
+  uint32_t today = _currentUnix / 86400;
+  oldest = UINT32_MAX;
+  File dir = SD.open(dirname);
+  if (!dir || !dir.isDirectory())
+  {
+    return false;
+  }
+  File file = dir.openNextFile();
+  while (file)
+  {
+    uint32_t day;
+    if (!file.isDirectory() && parseDayName(file.name(), suffix, day) && (!closedOnly || day < today) && day < oldest)
+    {
+      oldest = day;
+      path = String(dirname) + (String(dirname) == "/" ? "" : "/") + file.name();
+    }
+    file.close();
+    file = dir.openNextFile();
+  }
+  dir.close();
+  return oldest != UINT32_MAX;
+}
+
+static void Archive_ParseLine()
+{
+  int year, month, day, hour, minute, second;
+  unsigned long count;
+  float cpm, cph;
+  if (sscanf(_archiveLine, "%d-%d-%dT%d:%d:%d,%lu,%f,%f", &year, &month, &day, &hour, &minute, &second, &count, &cpm, &cph) != 9)
+  {
+    return; // Header or damaged row
+  }
+  uint32_t time = DateTime(year, month, day, hour, minute, second).unixtime();
+  if (_archiveSummary.rows == 0)
+  {
+    _archiveSummary.firstTime = time;
+  }
+  _archiveSummary.lastTime = time;
+  _archiveSummary.finalCount = count;
+  _archiveSummary.maxCpm = max(_archiveSummary.maxCpm, cpm);
+  _archiveSummary.maxCph = max(_archiveSummary.maxCph, cph);
+  if (_archiveSummary.rows < UINT16_MAX)
+  {
+    _archiveSummary.rows++;
+  }
+}
+
+// A day file that cannot be read is renamed to <date>.csv.bad and the next
+// day is archived. Anything else, e.g. a full card, is retried at the next
+// rollover.
+static void Archive_Abort(const char *reason, bool badSource = false)
+{
+  if (_archiveGzip.window != NULL)
+  {
+    Gzip_End(_archiveGzip);
+  }
+  _archiveGzip.out.close();
+  _archiveInput.close();
+  if (_archiveTarget != "" && SD.exists(_archiveTarget + ".tmp"))
+  {
+    SD.remove(_archiveTarget + ".tmp");
+  }
+  _archiveState = ARCHIVE_IDLE;
+  if (badSource && SD.rename(_archiveSource, _archiveSource + ".bad"))
+  {
+#ifdef DEBUG
+    Serial.printf("Archive: %s, set %s aside as .bad\n", reason, _archiveSource.c_str());
+#endif
+    return;
+  }
+  _archivePending = false;
+#ifdef DEBUG
+  Serial.printf("Archive: %s, giving up on %s until the next rollover\n", reason, _archiveSource.c_str());
+#endif
+}
+
+static void Archive_Begin()
+{
+  uint32_t day = 0;
+  parseDayName(_archiveSource.c_str() + 1, ".csv", day);
+  _archiveTarget = ARCHIVE_DIR + _archiveSource + ".gz";
+
+  if (!SD.exists(ARCHIVE_DIR))
+  {
+    SD.mkdir(ARCHIVE_DIR);
+  }
+  _archiveInput = SD.open(_archiveSource, FILE_READ);
+  File output = SD.open(_archiveTarget + ".tmp", FILE_WRITE);
+  _archiveGzip.window = NULL;
+  _archiveGzip.out = output;
+  _archiveState = ARCHIVE_COMPRESS;
+  if (!_archiveInput)
+  {
+    output.close();
+    Archive_Abort("Cannot open the day file", true);
+    return;
+  }
+  if (!output)
+  {
+    Archive_Abort("Cannot create the archive");
+    return;
+  }
+  if (!Gzip_Begin(_archiveGzip, output))
+  {
+    Archive_Abort("Out of memory");
+    return;
+  }
+
+  memset(&_archiveSummary, 0, sizeof(_archiveSummary));
+  _archiveSummary.version = DAY_SUMMARY_VERSION;
+  _archiveSummary.day = day;
+  _archiveSummary.rawBytes = _archiveInput.size();
+  _archiveLineLen = 0;
+#ifdef DEBUG
+  Serial.printf("Archive: Compressing %s\n", _archiveSource.c_str());
+#endif
+}
+
+static void Archive_Finish()
+{
+  Gzip_End(_archiveGzip);
+  bool failed = _archiveGzip.failed;
+  _archiveGzip.out.close();
+  _archiveInput.close();
+  if (failed)
+  {
+    Archive_Abort("Write error");
+    return;
+  }
+
+  if (SD.exists(_archiveTarget))
+  {
+    SD.remove(_archiveTarget);
+  }
+  SD.rename(_archiveTarget + ".tmp", _archiveTarget);
+  _archiveSummary.gzipBytes = _archiveGzip.outSize;
+  File summary = SD.open(ARCHIVE_SUMMARY_FILE, FILE_APPEND);
+  if (summary)
+  {
+    summary.write((const uint8_t *)&_archiveSummary, sizeof(_archiveSummary));
+    summary.close();
+  }
+  SD.remove(_archiveSource);
+  _archiveState = ARCHIVE_IDLE; // Look for another closed day
+
+#ifdef DEBUG
+  Serial.printf("Archive: %s done, %u rows, %lu -> %lu bytes\n", _archiveTarget.c_str(), _archiveSummary.rows,
+                (unsigned long)_archiveSummary.rawBytes, (unsigned long)_archiveSummary.gzipBytes);
+#endif
+}
+
+static void Archive_Step()
+{
+  static uint8_t buffer[ARCHIVE_CHUNK];
+  size_t n = _archiveInput.read(buffer, sizeof(buffer));
+  if (n == 0)
+  {
+    if (_archiveInput.position() < _archiveSummary.rawBytes)
+      Archive_Abort("Read error", true);
+    else
+      Archive_Finish();
+    return;
+  }
+  Gzip_Write(_archiveGzip, buffer, n);
+  for (size_t i = 0; i < n; i++)
+  {
+    if (buffer[i] == '\n')
+    {
+      _archiveLine[_archiveLineLen] = '\0';
+      Archive_ParseLine();
+      _archiveLineLen = 0;
+    }
+    else if (_archiveLineLen < sizeof(_archiveLine) - 1)
+    {
+      _archiveLine[_archiveLineLen++] = buffer[i];
+    }
+  }
+}
+
+// Deletes at most one archive per call, returns false once nothing is due
+static bool Archive_EnforceRetention()
+{
+  String path;
+  uint32_t oldest;
+  if (!findOldestDayFile(ARCHIVE_DIR, ".csv.gz", false, path, oldest))
+  {
+    return false;
+  }
+  uint32_t today = _currentUnix / 86400;
+  if (_archiveFreeBytes < 0)
+  {
+    _archiveFreeBytes = SD.totalBytes() - SD.usedBytes();
+  }
+  if (today <= oldest + ARCHIVE_RETENTION_DAYS && _archiveFreeBytes >= (int64_t)ARCHIVE_MIN_FREE_BYTES)
+  {
+    return false;
+  }
+  File file = SD.open(path, FILE_READ);
+  size_t size = file ? file.size() : 0;
+  file.close();
+  if (!SD.remove(path))
+  {
+    return false;
+  }
+  // Rounded up to a 32 KB cluster, the largest FAT32 uses
+  _archiveFreeBytes += (size + 32767) & ~(size_t)32767;
+#ifdef DEBUG
+  Serial.printf("Archive: Removed %s (about %lld bytes free)\n", path.c_str(), (long long)_archiveFreeBytes);
+#endif
+  return true;
+}
+
+void Archive_Request()
+{
+  _archivePending = true;
+}
+
+static void Archive_Job(void *context)
+{
+  if (SD.cardType() == CARD_NONE)
+  {
+    Archive_Abort("No SD card");
+  }
+  else
+  {
+    switch (_archiveState)
+    {
+    case ARCHIVE_IDLE:
+    {
+      uint32_t oldest;
+      if (findOldestDayFile("/", ".csv", true, _archiveSource, oldest))
+        Archive_Begin();
+      else
+        _archiveState = ARCHIVE_RETENTION;
+      break;
+    }
+    case ARCHIVE_COMPRESS:
+      Archive_Step();
+      break;
+    case ARCHIVE_RETENTION:
+      if (!Archive_EnforceRetention())
+      {
+        _archiveState = ARCHIVE_IDLE;
+        _archivePending = false;
+        _archiveFreeBytes = -1;
+      }
+      break;
+    }
+  }
+  _archiveJobQueued = false;
+}
+
+// Queues the next step once the previous one has run
+void Archive_Loop()
+{
+  if (_archiveJobQueued || (_archiveState == ARCHIVE_IDLE && !_archivePending))
+  {
+    return;
+  }
+  unsigned long currentTime = millis();
+  if (currentTime - _lastArchiveStep < archiveStepInterval)
+  {
+    return;
+  }
+  _lastArchiveStep = currentTime;
+  _archiveJobQueued = true;
+  if (!SD_Submit(SD_PRIO_BACKGROUND, Archive_Job, NULL))
+  {
+    _archiveJobQueued = false;
+  }
+}
+// MARK: MQTT
+struct MqttSample
+{
+  uint32_t time;
+  uint32_t count;
+  uint32_t delta; // Counts since the previous sample
+  float cpm;
+  float cph;
+};
+
+struct MqttInflight
+{
+  bool used;
+  bool acked;
+  int msgId;
+  ulong sentAt;
+  uint32_t spoolStart; // Byte range of the line in the spool file,
+  uint32_t spoolEnd;   // spoolEnd == 0 for a batch published straight from RAM
+  String payload;      // Only kept for batches published straight from RAM
+};
+
+static esp_mqtt_client_handle_t _mqttClient = NULL;
+static QueueHandle_t _mqttAckQueue = NULL;
+static volatile bool _mqttConnected = false;
+static volatile bool _mqttRestart = false;
+static volatile bool _mqttStopping = false; // A client is being torn down off loop()
+static bool _mqttStartPending = false;      // Start again once it is gone
+static String _mqttDeviceId;
+static String _mqttDataTopic;
+static String _mqttStatusTopic;
+
+static MqttSample _mqttBatch[MQTT_MAX_BATCH];
+static uint8_t _mqttBatchLen = 0;
+static ulong _mqttLastSample = 0;
+static uint32_t _mqttLastCount = 0;
+static uint32_t _mqttSeq = 0;
+
+static MqttInflight _mqttInflight[MQTT_MAX_INFLIGHT];
+static uint32_t _mqttSpoolSize = 0;      // Bytes in the spool file
+static uint32_t _mqttSpoolRead = 0;      // Next line to publish
+static uint32_t _mqttSpoolCommitted = 0; // Everything before this has been acknowledged
+static ulong _mqttLastDrain = 0;
+
+static uint32_t _mqttPublished = 0;
+static uint32_t _mqttAcked = 0;
+static uint32_t _mqttSpooled = 0;
+static uint32_t _mqttDropped = 0;
+
+// Runs in the MQTT client task, hand everything over to Mqtt_Loop()
+static void Mqtt_Event(void *handlerArgs, esp_event_base_t base, int32_t eventId, void *eventData)
+{
+  esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)eventData;
+  if (event->client != _mqttClient)
+  {
+    return; // A client being torn down
+  }
+  switch ((esp_mqtt_event_id_t)eventId)
+  {
+  case MQTT_EVENT_CONNECTED:
+    _mqttConnected = true;
+    esp_mqtt_client_publish(event->client, _mqttStatusTopic.c_str(), "online", 0, 1, 1);
+    break;
+  case MQTT_EVENT_DISCONNECTED:
+    _mqttConnected = false;
+    break;
+  case MQTT_EVENT_PUBLISHED:
+    xQueueSend(_mqttAckQueue, &event->msg_id, 0);
+    break;
+  default:
+    break;
+  }
+}
+
+static uint8_t Mqtt_InflightCount()
+{
+  uint8_t inflight = 0;
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+  {
+    if (_mqttInflight[i].used)
+      inflight++;
+  }
+  return inflight;
+}
+
+static MqttInflight *Mqtt_FreeSlot()
+{
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+  {
+    if (!_mqttInflight[i].used)
+      return &_mqttInflight[i];
+  }
+  return NULL;
+}
+
+static bool Mqtt_SpoolAppend(const String &payload)
+{
+  if (SD.cardType() == CARD_NONE || _mqttSpoolSize + payload.length() + 1 > MQTT_SPOOL_MAX_BYTES ||
+      !SD_Append(MQTT_SPOOL_FILE, payload + "\n"))
+  {
+    _mqttDropped++;
+#ifdef DEBUG
+    Serial.println("MQTT: Spool unavailable or full, batch dropped");
+#endif
+    return false;
+  }
+  // Counted as soon as it is queued, the worker appends in order
+  _mqttSpoolSize += payload.length() + 1;
+  _mqttSpooled++;
+  return true;
+}
+
+// Hands one message to the client's outbox without waiting on the network.
+// QoS 0 has no acknowledgement, so it counts as delivered once queued.
+static bool Mqtt_Publish(const String &payload, uint32_t spoolStart, uint32_t spoolEnd)
+{
+  MqttInflight *slot = Mqtt_FreeSlot();
+  if (slot == NULL)
+  {
+    return false;
+  }
+  int msgId = esp_mqtt_client_enqueue(_mqttClient, _mqttDataTopic.c_str(), payload.c_str(), payload.length(), config.mqttQos, 0, true);
+  if (msgId < 0)
+  {
+    return false;
+  }
+  _mqttPublished++;
+  slot->used = true;
+  slot->acked = config.mqttQos == 0;
+  slot->msgId = msgId;
+  slot->sentAt = millis();
+  slot->spoolStart = spoolStart;
+  slot->spoolEnd = spoolEnd;
+  slot->payload = spoolEnd == 0 ? payload : String();
+  if (slot->acked)
+  {
+    _mqttAcked++;
+  }
+  return true;
+}
+
+static void Mqtt_FlushBatch()
+{
+  if (_mqttBatchLen == 0)
+  {
+    return;
+  }
+  JsonDocument doc;
+  doc["device"] = _mqttDeviceId;
+  doc["seq"] = _mqttSeq++;
+  doc["interval"] = config.mqttInterval;
+  JsonArray fields = doc["fields"].to<JsonArray>();
+  fields.add("time");
+  fields.add("count");
+  fields.add("delta");
+  fields.add("cpm");
+  fields.add("cph");
+  JsonArray samples = doc["samples"].to<JsonArray>();
+  for (uint8_t i = 0; i < _mqttBatchLen; i++)
+  {
+    JsonArray row = samples.add<JsonArray>();
+    row.add(_mqttBatch[i].time);
+    row.add(_mqttBatch[i].count);
+    row.add(_mqttBatch[i].delta);
+    row.add(roundf(_mqttBatch[i].cpm * 100) / 100);
+    row.add(roundf(_mqttBatch[i].cph * 100) / 100);
+  }
+  _mqttBatchLen = 0;
+
+  String payload;
+  serializeJson(doc, payload);
+  // Anything already waiting in the spool goes first, so keep the order
+  bool backlog = _mqttSpoolSize > _mqttSpoolCommitted;
+  if (backlog || !_mqttConnected || !Mqtt_Publish(payload, 0, 0))
+  {
+    Mqtt_SpoolAppend(payload);
+  }
+}
+
+// Takes back everything still unacknowledged: RAM batches are spooled and the
+// spool is re-read from the last committed line. Delivery is at-least-once,
+// receivers can drop repeats by "seq".
+static void Mqtt_Requeue()
+{
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+  {
+    MqttInflight &entry = _mqttInflight[i];
+    if (entry.used && entry.spoolEnd == 0 && !entry.acked)
+    {
+      Mqtt_SpoolAppend(entry.payload);
+    }
+    entry.used = false;
+    entry.payload = String();
+  }
+  _mqttSpoolRead = _mqttSpoolCommitted;
+}
+
+// Releases acknowledged messages and moves the spool commit point over the
+// acknowledged lines that directly follow it.
+static void Mqtt_Commit()
+{
+  bool advanced = true;
+  while (advanced)
+  {
+    advanced = false;
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+    {
+      MqttInflight &entry = _mqttInflight[i];
+      if (!entry.used || !entry.acked)
+        continue;
+      if (entry.spoolEnd == 0)
+      {
+        entry.used = false;
+        entry.payload = String();
+      }
+      else if (entry.spoolStart == _mqttSpoolCommitted)
+      {
+        _mqttSpoolCommitted = entry.spoolEnd;
+        entry.used = false;
+        advanced = true;
+      }
+    }
+  }
+
+  if (_mqttSpoolSize > 0 && _mqttSpoolCommitted >= _mqttSpoolSize && Mqtt_InflightCount() == 0 &&
+      SD_Remove(MQTT_SPOOL_FILE))
+  {
+    _mqttSpoolSize = 0;
+    _mqttSpoolRead = 0;
+    _mqttSpoolCommitted = 0;
+    preferences.putULong(PREF_KEY_MQTT_SPOOL_POS, 0);
+#ifdef DEBUG
+    Serial.println("MQTT: Spool drained");
+#endif
+  }
+}
+
+struct MqttDrainJob
+{
+  uint32_t offset;
+  uint32_t end;
+  uint32_t size; // Of the file as the worker found it
+  bool failed;   // Open or seek went wrong, says nothing about the file's length
+  String payload;
+  volatile bool busy;  // Queued on the SD worker
+  volatile bool ready; // Result waiting for Mqtt_Drain()
+};
+static MqttDrainJob _mqttDrainJob;
+
+static void Mqtt_DrainJob(void *context)
+{
+  File spool = SD.open(MQTT_SPOOL_FILE, FILE_READ);
+  _mqttDrainJob.end = _mqttDrainJob.offset;
+  _mqttDrainJob.size = 0;
+  _mqttDrainJob.payload = String();
+  _mqttDrainJob.failed = !spool;
+  if (spool)
+  {
+    _mqttDrainJob.size = spool.size();
+    if (_mqttDrainJob.offset < _mqttDrainJob.size)
+    {
+      _mqttDrainJob.failed = !spool.seek(_mqttDrainJob.offset);
+      if (!_mqttDrainJob.failed)
+      {
+        _mqttDrainJob.payload = spool.readStringUntil('\n');
+        _mqttDrainJob.end = spool.position();
+      }
+    }
+  }
+  spool.close();
+  _mqttDrainJob.ready = true;
+  _mqttDrainJob.busy = false;
+}
+
+// Reads the next spooled line on the SD worker and publishes it on a later pass
+static void Mqtt_Drain()
+{
+  if (_mqttDrainJob.ready)
+  {
+    _mqttDrainJob.ready = false;
+    if (_mqttDrainJob.offset != _mqttSpoolRead)
+    {
+      return; // Requeued in the meantime, read again from the new position
+    }
+    uint32_t end = _mqttDrainJob.end;
+    if (_mqttDrainJob.failed || (end <= _mqttSpoolRead && _mqttDrainJob.size > _mqttSpoolRead))
+    {
+      // Card trouble, the line is read again on the next pass
+#ifdef DEBUG
+      Serial.println("MQTT: Spool read failed, retrying");
+#endif
+      return;
+    }
+    if (end <= _mqttSpoolRead)
+    {
+      // The file really ends here, the appends past it never reached the card.
+      // Start over from an empty spool.
+      _mqttSpoolSize = _mqttSpoolCommitted = _mqttSpoolRead;
+      return;
+    }
+    if (_mqttDrainJob.payload.length() == 0)
+    {
+      // Blank line, nothing to publish or acknowledge
+      if (_mqttSpoolCommitted == _mqttSpoolRead)
+        _mqttSpoolCommitted = end;
+      _mqttSpoolRead = end;
+    }
+    else if (Mqtt_Publish(_mqttDrainJob.payload, _mqttSpoolRead, end))
+    {
+      _mqttSpoolRead = end;
+    }
+    _mqttDrainJob.payload = String();
+    return;
+  }
+
+  if (_mqttDrainJob.busy || _mqttSpoolRead >= _mqttSpoolSize || Mqtt_FreeSlot() == NULL)
+  {
+    return;
+  }
+  _mqttDrainJob.offset = _mqttSpoolRead;
+  _mqttDrainJob.busy = true;
+  if (!SD_Submit(SD_PRIO_BACKGROUND, Mqtt_DrainJob, NULL))
+  {
+    _mqttDrainJob.busy = false;
+  }
+}
+
+void Mqtt_Init()
+{
+  _mqttSeq = preferences.getUInt(PREF_KEY_MQTT_SEQ, 0);
+
+  SdStatJob stat = {MQTT_SPOOL_FILE, false, false, false, 0};
+  SD_Run(SD_PRIO_BACKGROUND, SD_StatJob, &stat, portMAX_DELAY);
+  _mqttSpoolSize = stat.found ? stat.size : 0;
+  _mqttSpoolCommitted = min((uint32_t)preferences.getULong(PREF_KEY_MQTT_SPOOL_POS, 0), _mqttSpoolSize);
+  _mqttSpoolRead = _mqttSpoolCommitted;
+  _mqttLastCount = _count;
+  _mqttLastSample = millis();
+
+#ifdef DEBUG
+  Serial.printf("MQTT: %s, %lu spooled bytes pending\n", config.mqttEnabled ? config.mqttUri : "disabled",
+                (unsigned long)(_mqttSpoolSize - _mqttSpoolCommitted));
+#endif
+  Mqtt_Start();
+}
+
+void Mqtt_Start()
+{
+  if (!config.mqttEnabled || config.mqttUri[0] == '\0' || _mqttClient != NULL || _mqttStopping)
+  {
+    return;
+  }
+  _mqttConnected = false;
+  if (_mqttAckQueue == NULL)
+  {
+    _mqttAckQueue = xQueueCreate(16, sizeof(int));
+  }
+  _mqttDeviceId = WiFi.macAddress();
+  _mqttDeviceId.replace(":", "");
+  _mqttDeviceId.toLowerCase();
+  _mqttDataTopic = String(config.mqttTopic) + "/" + _mqttDeviceId + "/counts";
+  _mqttStatusTopic = String(config.mqttTopic) + "/" + _mqttDeviceId + "/status";
+
+  esp_mqtt_client_config_t mqttConfig = {};
+#if ESP_IDF_VERSION_MAJOR >= 5
+  mqttConfig.broker.address.uri = config.mqttUri;
+  mqttConfig.credentials.client_id = _mqttDeviceId.c_str();
+  mqttConfig.credentials.username = config.mqttUsername[0] == '\0' ? NULL : config.mqttUsername;
+  mqttConfig.credentials.authentication.password = config.mqttPassword[0] == '\0' ? NULL : config.mqttPassword;
+  mqttConfig.session.last_will.topic = _mqttStatusTopic.c_str();
+  mqttConfig.session.last_will.msg = "offline";
+  mqttConfig.session.last_will.qos = 1;
+  mqttConfig.session.last_will.retain = 1;
+#else
+  mqttConfig.uri = config.mqttUri;
+  mqttConfig.client_id = _mqttDeviceId.c_str();
+  mqttConfig.username = config.mqttUsername[0] == '\0' ? NULL : config.mqttUsername;
+  mqttConfig.password = config.mqttPassword[0] == '\0' ? NULL : config.mqttPassword;
+  mqttConfig.lwt_topic = _mqttStatusTopic.c_str();
+  mqttConfig.lwt_msg = "offline";
+  mqttConfig.lwt_qos = 1;
+  mqttConfig.lwt_retain = 1;
+#endif
+  _mqttClient = esp_mqtt_client_init(&mqttConfig);
+  if (_mqttClient == NULL)
+  {
+#ifdef DEBUG
+    Serial.println("MQTT: Invalid client configuration");
+#endif
+    return;
+  }
+  esp_mqtt_client_register_event(_mqttClient, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, Mqtt_Event, NULL);
+  esp_mqtt_client_start(_mqttClient);
+}
+
+// Stopping waits for the MQTT task to close its socket, as long as a network
+// timeout with the broker unreachable, so it runs in a task of its own
+static void Mqtt_StopTask(void *arg)
+{
+  esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)arg;
+  esp_mqtt_client_stop(client);
+  esp_mqtt_client_destroy(client);
+  _mqttStopping = false;
+  vTaskDelete(NULL);
+}
+
+// Detaches the client and returns at once, _mqttStopping is set until it is gone
+void Mqtt_Stop()
+{
+  if (_mqttClient == NULL || _mqttStopping)
+  {
+    return;
+  }
+  esp_mqtt_client_handle_t client = _mqttClient;
+  _mqttClient = NULL;
+  _mqttConnected = false;
+  Mqtt_Requeue();
+  _mqttStopping = true;
+  if (xTaskCreate(Mqtt_StopTask, "mqtt_stop", 3072, client, 1, NULL) != pdPASS)
+  {
+    Mqtt_StopTask(client); // Out of memory, pay the wait here rather than leak the client
+  }
+}
+
+void Mqtt_Loop()
+{
+  if (_mqttRestart && !_mqttStopping)
+  {
+    _mqttRestart = false;
+    Mqtt_Stop();
+    _mqttStartPending = true;
+  }
+  if (_mqttStartPending && !_mqttStopping)
+  {
+    _mqttStartPending = false;
+    Mqtt_Start();
+  }
+  if (_mqttClient == NULL)
+  {
+    return;
+  }
+  unsigned long currentTime = millis();
+
+  if (currentTime - _mqttLastSample >= (ulong)config.mqttInterval * 1000)
+  {
+    _mqttLastSample = currentTime;
+    uint32_t count = _count;
+    // A reset (midnight or manual) restarts the count, the delta is what came after
+    uint32_t delta = count >= _mqttLastCount ? count - _mqttLastCount : count;
+    _mqttLastCount = count;
+    _mqttBatch[_mqttBatchLen++] = {_currentUnix, count, delta, (float)_runningAverageCPM, (float)_runningAverageCPH};
+    if (_mqttBatchLen >= config.mqttBatch)
+    {
+      Mqtt_FlushBatch();
+    }
+  }
+
+  int msgId;
+  while (xQueueReceive(_mqttAckQueue, &msgId, 0) == pdTRUE)
+  {
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+    {
+      if (_mqttInflight[i].used && !_mqttInflight[i].acked && _mqttInflight[i].msgId == msgId)
+      {
+        _mqttInflight[i].acked = true;
+        _mqttAcked++;
+      }
+    }
+  }
+
+  bool expired = false;
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+  {
+    if (_mqttInflight[i].used && !_mqttInflight[i].acked && currentTime - _mqttInflight[i].sentAt > mqttAckTimeout)
+      expired = true;
+  }
+  Mqtt_Commit();
+  if ((!_mqttConnected || expired) && Mqtt_InflightCount() > 0)
+  {
+#ifdef DEBUG
+    Serial.println(expired ? "MQTT: Acknowledgement timeout, requeueing" : "MQTT: Disconnected, requeueing");
+#endif
+    Mqtt_Requeue();
+  }
+
+  if (_mqttConnected && currentTime - _mqttLastDrain >= mqttDrainInterval)
+  {
+    _mqttLastDrain = currentTime;
+    Mqtt_Drain();
+  }
+}
+
+String Mqtt_StatusJson()
 {
-  if (!rtc.begin())
+  DeviceConfig current;
+  Config_Snapshot(current);
+  JsonDocument doc;
+  doc["enabled"] = current.mqttEnabled;
+  doc["uri"] = current.mqttUri;
+  doc["topic"] = _mqttDataTopic;
+  doc["connected"] = (bool)_mqttConnected;
+  doc["inflight"] = Mqtt_InflightCount();
+  doc["pendingSamples"] = _mqttBatchLen;
+  doc["spoolBytes"] = _mqttSpoolSize - _mqttSpoolCommitted;
+  doc["published"] = _mqttPublished;
+  doc["acked"] = _mqttAcked;
+  doc["spooled"] = _mqttSpooled;
+  doc["dropped"] = _mqttDropped;
+  doc["seq"] = _mqttSeq;
+
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
+}
+
+// The client is torn down from loop(), not from the web server task
+void Mqtt_Restart()
+{
+  _mqttRestart = true;
+}
+
+void Mqtt_SettingsToJson(JsonObject doc, const DeviceConfig &cfg)
+{
+  doc["enabled"] = cfg.mqttEnabled;
+  doc["uri"] = cfg.mqttUri;
+  doc["username"] = cfg.mqttUsername;
+  doc["topic"] = cfg.mqttTopic;
+  doc["qos"] = cfg.mqttQos;
+  doc["interval"] = cfg.mqttInterval;
+  doc["batch"] = cfg.mqttBatch;
+}
+
+bool Mqtt_SettingsFromJson(JsonVariantConst doc, DeviceConfig &cfg, String &error)
+{
+  int qos = doc["qos"] | (int)cfg.mqttQos;
+  int interval = doc["interval"] | (int)cfg.mqttInterval;
+  int batch = doc["batch"] | (int)cfg.mqttBatch;
+  if (qos < 0 || qos > 2)
   {
-    Serial.println("Couldn't find RTC");
-    Serial.flush();
+    error = "Invalid QoS.";
+    return false;
   }
-  if (rtc.lostPower())
+  if (interval < 1 || interval > 3600 || batch < 1 || batch > MQTT_MAX_BATCH)
   {
-    Serial.println("RTC lost power, setting the time!");
-    rtc.adjust(DateTime(F(__DATE__), F(__TIME__)));
+    error = "Invalid interval or batch size.";
+    return false;
   }
-  rtc.disable32K();
+  String uri = doc["uri"] | String(cfg.mqttUri);
+  if (uri != "" && !uri.startsWith("mqtt://") && !uri.startsWith("mqtts://"))
+  {
+    error = "Broker URI must start with mqtt:// or mqtts://";
+    return false;
+  }
+  String username = doc["username"] | String(cfg.mqttUsername);
+  String password = doc["password"] | String(cfg.mqttPassword);
+  String topic = doc["topic"] | String(cfg.mqttTopic);
+  if (uri.length() >= sizeof(cfg.mqttUri) || username.length() >= sizeof(cfg.mqttUsername) ||
+      password.length() >= sizeof(cfg.mqttPassword) || topic == "" || topic.length() >= sizeof(cfg.mqttTopic))
+  {
+    error = "Invalid URI, username, password or topic.";
+    return false;
+  }
+
+  strlcpy(cfg.mqttUri, uri.c_str(), sizeof(cfg.mqttUri));
+  strlcpy(cfg.mqttUsername, username.c_str(), sizeof(cfg.mqttUsername));
+  strlcpy(cfg.mqttPassword, password.c_str(), sizeof(cfg.mqttPassword));
+  strlcpy(cfg.mqttTopic, topic.c_str(), sizeof(cfg.mqttTopic));
+
+  cfg.mqttEnabled = doc["enabled"] | cfg.mqttEnabled;
+  cfg.mqttQos = qos;
+  cfg.mqttInterval = interval;
+  cfg.mqttBatch = batch;
+  return true;
 }
 
-DateTime RTC_getTime()
+// Called from Save_To_Preferences()
+void Mqtt_SaveState()
 {
-  DateTime now = rtc.now();
-  return now;
+  // Both only move while there is traffic, skip the NVS writes when idle
+  static uint32_t savedSpoolPos = UINT32_MAX;
+  static uint32_t savedSeq = UINT32_MAX;
+  if (_mqttSpoolCommitted != savedSpoolPos)
+  {
+    preferences.putULong(PREF_KEY_MQTT_SPOOL_POS, _mqttSpoolCommitted);
+    savedSpoolPos = _mqttSpoolCommitted;
+  }
+  if (_mqttSeq != savedSeq)
+  {
+    preferences.putUInt(PREF_KEY_MQTT_SEQ, _mqttSeq);
+    savedSeq = _mqttSeq;
+  }
 }
-// MARK: SD_Init
-void SD_Init()
+// MARK: OTA
+// Images are streamed straight into the inactive app slot, or the LittleFS
+// partition, as the upload arrives. Gzip uploads are inflated on the fly by
+// the ROM's tinfl into a 32 KB window. The SHA-256 of the uploaded bytes has
+// to match the X-Update-SHA256 header before the image is activated.
+enum OtaGzipState
 {
-  if (!SD.begin()) // Pass CS pin if not default, e.g., SD.begin(SS_PIN)
+  OTA_GZ_HEADER,     // Fixed 10-byte header
+  OTA_GZ_EXTRA_LEN,  // Optional fields, in this order
+  OTA_GZ_EXTRA,
+  OTA_GZ_NAME,
+  OTA_GZ_COMMENT,
+  OTA_GZ_HEADER_CRC,
+  OTA_GZ_BODY,
+  OTA_GZ_DONE        // Deflate stream ended, only the trailer may follow
+};
+
+struct OtaSession
+{
+  AsyncWebServerRequest *request; // NULL while no upload is running
+  bool filesystem;
+  bool failed;
+  int failCode;
+  mbedtls_sha256_context sha;
+  uint8_t expected[32];
+  uint32_t received; // Bytes uploaded
+  uint32_t written;  // Bytes flashed
+
+  bool gzip;
+  OtaGzipState gzState;
+  uint8_t gzFlags; // Optional header fields still to skip
+  uint8_t gzBuf[10];
+  uint8_t gzBufLen;
+  uint16_t gzSkip;
+  bool gzPending; // tinfl has output left over
+  uint32_t gzCrc;
+  uint32_t gzBodyEnd;   // Upload offset of the 8-byte trailer
+  uint8_t gzTrailer[8]; // CRC-32 and size of the inflated image
+  tinfl_decompressor *inflator;
+  uint8_t *dict; // TINFL_LZ_DICT_SIZE bytes, wraps around
+  size_t dictPos;
+};
+
+static OtaSession _ota = {};
+static String _otaState = "idle"; // idle, receiving, done, failed
+static String _otaTarget = "";
+static String _otaError = "";
+static bool _otaRestart = false;
+static ulong _otaRestartRequested = 0;
+static bool _otaPendingVerify = false;
+static bool _otaRolledBack = false;
+
+// Keeps the Arduino core from confirming a new image by itself when the
+// bootloader has rollback enabled, Ota_Loop() confirms it once it has run.
+extern "C" bool verifyRollbackLater()
+{
+  return true;
+}
+
+void Ota_Init()
+{
+  Preferences ota;
+  ota.begin(OTA_PREFS_NAMESPACE);
+  uint8_t trial = ota.getUChar(OTA_KEY_TRIAL, 0);
+  _otaRolledBack = ota.getBool(OTA_KEY_ROLLED_BACK, false);
+  const esp_partition_t *running = esp_ota_get_running_partition();
+
+  if (trial > 0 && running != NULL && ota.getString(OTA_KEY_SLOT, "") != running->label)
+  {
+    // The bootloader already went back to the previous image
+    ota.putUChar(OTA_KEY_TRIAL, 0);
+    ota.putBool(OTA_KEY_ROLLED_BACK, true);
+    _otaRolledBack = true;
+    trial = 0;
+  }
+  else if (trial > OTA_MAX_TRIAL_BOOTS)
   {
+    // The new image never stayed up long enough to confirm itself
+    ota.putUChar(OTA_KEY_TRIAL, 0);
+    ota.putBool(OTA_KEY_ROLLED_BACK, true);
+    ota.end();
+    const esp_partition_t *previous = esp_ota_get_next_update_partition(NULL);
+    if (previous != NULL && esp_ota_set_boot_partition(previous) == ESP_OK)
+    {
 #ifdef DEBUG
-    Serial.println("Card Mount Failed");
+      Serial.printf("OTA: Image failed %u boots, rolling back to %s\n", OTA_MAX_TRIAL_BOOTS, previous->label);
 #endif
+      ESP.restart();
+    }
+    _otaRolledBack = true;
     return;
   }
-  uint8_t cardType = SD.cardType();
-  if (cardType == CARD_NONE)
+  else if (trial > 0)
   {
+    ota.putUChar(OTA_KEY_TRIAL, trial + 1);
+  }
+  ota.end();
+
+  esp_ota_img_states_t state;
+  _otaPendingVerify = trial > 0 || (running != NULL && esp_ota_get_state_partition(running, &state) == ESP_OK &&
+                                    state == ESP_OTA_IMG_PENDING_VERIFY);
 #ifdef DEBUG
-    Serial.println("No SD card attached");
+  Serial.printf("OTA: Running from %s%s\n", running != NULL ? running->label : "?",
+                _otaPendingVerify ? ", waiting to confirm the new image" : "");
 #endif
-    return;
+}
+
+void Ota_Loop()
+{
+  if (_otaRestart && millis() - _otaRestartRequested >= otaRestartDelay)
+  {
+    ESP.restart();
   }
+  if (_otaPendingVerify && millis() >= otaConfirmDelay)
+  {
+    _otaPendingVerify = false;
+    Preferences ota;
+    ota.begin(OTA_PREFS_NAMESPACE);
+    ota.putUChar(OTA_KEY_TRIAL, 0);
+    ota.end();
+    esp_ota_mark_app_valid_cancel_rollback();
 #ifdef DEBUG
-  Serial.print("SD Card Type: ");
-  if (cardType == CARD_MMC)
-    Serial.println("MMC");
-  else if (cardType == CARD_SD)
-    Serial.println("SDSC");
-  else if (cardType == CARD_SDHC)
-    Serial.println("SDHC");
-  else
-    Serial.println("Unknown type");
-  uint64_t cardSize = SD.cardSize() / (1024 * 1024);
-  Serial.printf("SD Card Size: %lluMB\n", cardSize);
+    Serial.println("OTA: New image confirmed");
 #endif
+  }
 }
-// MARK: listDir
-String listDir(fs::FS &fs, const char *dirname, uint8_t levels)
-{
-  JsonDocument doc; // For ArduinoJson v6+
 
-  File root = fs.open(dirname);
-  if (!root)
+static void Ota_Fail(int code, const String &reason)
+{
+  if (_ota.failed)
   {
-    root.close(); // Ensure closed even if open failed or was invalid
+    return;
+  }
+  _ota.failed = true;
+  _ota.failCode = code;
+  _otaState = "failed";
+  _otaError = reason;
+  Update.abort();
 #ifdef DEBUG
-    Serial.printf("Failed to open directory: %s\n", dirname);
+  Serial.println("OTA: " + reason);
 #endif
-    return "Failed to open directory";
-  }
-  if (!root.isDirectory())
+}
+
+static void Ota_Release()
+{
+  mbedtls_sha256_free(&_ota.sha);
+  free(_ota.inflator);
+  free(_ota.dict);
+  _ota.inflator = NULL;
+  _ota.dict = NULL;
+  if (_ota.filesystem && !LittleFS.begin())
   {
-    root.close(); // Close the handle
 #ifdef DEBUG
-    Serial.printf("Not a directory: %s\n", dirname);
+    Serial.println("OTA: LittleFS does not mount, upload the web assets again");
 #endif
-    return "Not a directory";
   }
+  _ota.request = NULL;
+}
 
-  File file = root.openNextFile();
-  while (file)
+static bool parseSha256(const String &hex, uint8_t *digest)
+{
+  if (hex.length() != 64)
   {
-    String entryName = file.name(); // This is just the name, e.g., "file.txt" or "subdir"
-    String fullEntryPath;
-
-    // Construct the full absolute path for the current entry
-    if (String(dirname) == "/")
+    return false;
+  }
+  for (uint8_t i = 0; i < 32; i++)
+  {
+    char pair[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+    if (!isxdigit(pair[0]) || !isxdigit(pair[1]))
     {
-      fullEntryPath = "/" + entryName;
+      return false;
     }
-    else
+    digest[i] = strtoul(pair, NULL, 16);
+  }
+  return true;
+}
+
+static void Ota_Begin(AsyncWebServerRequest *request, const uint8_t *data, size_t len, size_t total)
+{
+  if (_ota.request != NULL)
+  {
+    // Freed with the request
+    request->_tempObject = strdup("Another update is in progress.");
+    return;
+  }
+  memset(&_ota, 0, sizeof(_ota));
+  mbedtls_sha256_init(&_ota.sha);
+  mbedtls_sha256_starts(&_ota.sha, 0);
+  _ota.request = request;
+  _otaState = "receiving";
+  _otaError = "";
+  request->onDisconnect([request]()
+                        {
+    if (_ota.request == request) {
+      Ota_Fail(400, "Upload interrupted.");
+      Ota_Release();
+    } });
+
+  _otaTarget = request->hasParam("target") ? request->getParam("target")->value() : "firmware";
+  _ota.filesystem = _otaTarget == "filesystem";
+  if (!_ota.filesystem && _otaTarget != "firmware")
+  {
+    Ota_Fail(400, "Target must be firmware or filesystem.");
+    return;
+  }
+  if (!request->hasHeader(OTA_SHA256_HEADER) || !parseSha256(request->getHeader(OTA_SHA256_HEADER)->value(), _ota.expected))
+  {
+    Ota_Fail(400, "The " OTA_SHA256_HEADER " header must hold the image's SHA-256 in hex.");
+    return;
+  }
+
+  _ota.gzip = len >= 2 && data[0] == 0x1F && data[1] == 0x8B;
+  if (_ota.gzip)
+  {
+    _ota.inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    _ota.dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (_ota.inflator == NULL || _ota.dict == NULL)
     {
-      String basePath = dirname;
-      // Ensure basePath does not end with a slash if it's not the root, before appending another
-      if (basePath.endsWith("/"))
-      {
-        basePath.remove(basePath.length() - 1);
-      }
-      fullEntryPath = basePath + "/" + entryName;
+      Ota_Fail(500, "Not enough memory to inflate the image.");
+      return;
     }
-    // Sanitize: remove any double slashes that might have formed (e.g. if dirname was "/" and somehow logic above failed)
-    while (fullEntryPath.indexOf("//") != -1)
+    if (total < 18)
     {
-      fullEntryPath.replace("//", "/");
+      Ota_Fail(400, "Gzip stream is truncated.");
+      return;
     }
+    tinfl_init(_ota.inflator);
+    _ota.gzState = OTA_GZ_HEADER;
+    _ota.gzBodyEnd = total - sizeof(_ota.gzTrailer);
+  }
 
-    if (file.isDirectory())
-    {
+  if (_ota.filesystem)
+  {
+    LittleFS.end();
+  }
+  // The inflated size is only known at the end, Update then takes the whole slot
+  if (!Update.begin(_ota.gzip ? UPDATE_SIZE_UNKNOWN : total, _ota.filesystem ? U_SPIFFS : U_FLASH))
+  {
+    Ota_Fail(400, Update.errorString());
+    return;
+  }
 #ifdef DEBUG
-      Serial.printf("listDir: Dir: %s\n", fullEntryPath.c_str());
+  Serial.printf("OTA: Receiving %s, %u bytes%s\n", _otaTarget.c_str(), total, _ota.gzip ? " gzipped" : "");
 #endif
-      if (levels > 0)
-      {
-        String childrenJsonString = listDir(fs, fullEntryPath.c_str(), levels - 1);
-        JsonDocument childrenDoc;
-        DeserializationError error = deserializeJson(childrenDoc, childrenJsonString);
+}
 
-        if (!error)
-        {
-          if (childrenDoc.is<JsonArray>())
-          {
-            for (JsonVariant child : childrenDoc.as<JsonArray>())
-            {
-              if (child.is<const char *>())
-              { // Ensure it's a string before adding
-                doc.add(child.as<String>());
-              }
-            }
-          }
-          else if (childrenDoc.containsKey("error"))
-          {
-#ifdef DEBUG
-            Serial.printf("listDir: Error in subdirectory %s: %s\n", fullEntryPath.c_str(), childrenDoc["error"].as<const char *>());
-#endif
-          }
-        }
-        else
-        {
-#ifdef DEBUG
-          Serial.printf("listDir: Failed to parse children JSON for %s: %s\n", fullEntryPath.c_str(), error.c_str());
-#endif
-        }
-      }
-    }
-    else
-    {
-#ifdef DEBUG
-      Serial.printf("listDir: File: %s, Size: %lu\n", fullEntryPath.c_str(), file.size());
-#endif
-      doc.add(fullEntryPath); // Add the full absolute path of the file
-    }
-    file.close();
-    file = root.openNextFile();
+static void Ota_Flash(uint8_t *data, size_t len)
+{
+  if (Update.write(data, len) != len)
+  {
+    Ota_Fail(500, Update.errorString());
+    return;
   }
-  root.close();
+  _ota.written += len;
+}
 
-  String jsonOutput;
-  if (doc.size() == 0 && String(dirname) != "/" && !fs.exists(dirname))
+// Moves on to the next optional gzip header field the flags announce
+static void Ota_GzipNextField()
+{
+  _ota.gzBufLen = 0;
+  if (_ota.gzFlags & 0x04)
   {
-    // If we listed an empty directory that doesn't actually exist (e.g. after a failed fs.open on a non-existent path that somehow passed initial checks)
-    // This case is less likely if initial open fails correctly.
-    // However, if the directory is simply empty, an empty array is correct.
+    _ota.gzFlags &= ~0x04;
+    _ota.gzState = OTA_GZ_EXTRA_LEN;
+  }
+  else if (_ota.gzFlags & 0x08)
+  {
+    _ota.gzFlags &= ~0x08;
+    _ota.gzState = OTA_GZ_NAME;
+  }
+  else if (_ota.gzFlags & 0x10)
+  {
+    _ota.gzFlags &= ~0x10;
+    _ota.gzState = OTA_GZ_COMMENT;
+  }
+  else if (_ota.gzFlags & 0x02)
+  {
+    _ota.gzFlags &= ~0x02;
+    _ota.gzSkip = 2;
+    _ota.gzState = OTA_GZ_HEADER_CRC;
+  }
+  else
+  {
+    _ota.gzState = OTA_GZ_BODY;
   }
-
-  serializeJson(doc, jsonOutput);
-  return jsonOutput;
 }
-// MARK: Log_SD
-void Log_SD(ulong interval)
+
+// Takes the upload up to the trailer, last is set for the part that reaches it
+static void Ota_Inflate(const uint8_t *data, size_t len, bool last)
 {
-  unsigned long currentTime = millis();
-  if (SD.cardType() != CARD_NONE && currentTime - _lastLogTime > interval && _count != _lastLogCount)
+  while ((len > 0 || (_ota.gzState == OTA_GZ_BODY && _ota.gzPending)) && !_ota.failed)
   {
-    DateTime now = RTC_getTime();
-    String filename = "/";                               // Logs are stored in the root
-    filename += now.timestamp(DateTime::TIMESTAMP_DATE); // e.g., YYYY-MM-DD
-    filename += ".csv";
-
-    File dataFile;
-    bool newFile = false;
-
-    if (!SD.exists(filename.c_str()))
+    switch (_ota.gzState)
     {
-      dataFile = SD.open(filename.c_str(), FILE_WRITE);
-      if (dataFile)
+    case OTA_GZ_HEADER:
+      _ota.gzBuf[_ota.gzBufLen++] = *data++;
+      len--;
+      if (_ota.gzBufLen == 10)
       {
-        dataFile.println("time,count,cpm,cph"); // Write header for new file
-        newFile = true;
+        if (_ota.gzBuf[2] != 8)
+        {
+          Ota_Fail(400, "Unsupported gzip compression method.");
+          return;
+        }
+        _ota.gzFlags = _ota.gzBuf[3];
+        Ota_GzipNextField();
       }
-      else
+      break;
+    case OTA_GZ_EXTRA_LEN:
+      _ota.gzBuf[_ota.gzBufLen++] = *data++;
+      len--;
+      if (_ota.gzBufLen == 2)
       {
-#ifdef DEBUG
-        Serial.println("Log_SD: Error creating file: " + filename);
-#endif
-        return;
+        _ota.gzSkip = _ota.gzBuf[0] | (_ota.gzBuf[1] << 8);
+        _ota.gzState = OTA_GZ_EXTRA;
+      }
+      break;
+    case OTA_GZ_EXTRA:
+    case OTA_GZ_HEADER_CRC:
+    {
+      size_t n = min(len, (size_t)_ota.gzSkip);
+      data += n;
+      len -= n;
+      _ota.gzSkip -= n;
+      if (_ota.gzSkip == 0)
+      {
+        Ota_GzipNextField();
       }
+      break;
     }
-    else
+    case OTA_GZ_NAME:
+    case OTA_GZ_COMMENT:
+      len--;
+      if (*data++ == '\0')
+      {
+        Ota_GzipNextField();
+      }
+      break;
+    case OTA_GZ_BODY:
     {
-      dataFile = SD.open(filename.c_str(), FILE_APPEND);
-      if (!dataFile)
+      size_t inBytes = len;
+      size_t outBytes = TINFL_LZ_DICT_SIZE - _ota.dictPos;
+      tinfl_status status = tinfl_decompress(_ota.inflator, data, &inBytes, _ota.dict, _ota.dict + _ota.dictPos,
+                                             &outBytes, last ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+      data += inBytes;
+      len -= inBytes;
+      if (outBytes > 0)
       {
-#ifdef DEBUG
-        Serial.println("Log_SD: Error opening file for append: " + filename);
-#endif
-        return;
+        _ota.gzCrc = crc32Update(_ota.gzCrc, _ota.dict + _ota.dictPos, outBytes);
+        Ota_Flash(_ota.dict + _ota.dictPos, outBytes);
+        _ota.dictPos = (_ota.dictPos + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+      }
+      _ota.gzPending = status == TINFL_STATUS_HAS_MORE_OUTPUT;
+      if (status == TINFL_STATUS_DONE)
+      {
+        _ota.gzState = OTA_GZ_DONE;
       }
+      else if (status < TINFL_STATUS_DONE)
+      {
+        Ota_Fail(400, last ? "Gzip stream is truncated or corrupt." : "Corrupt gzip data.");
+      }
+      break;
+    }
+    case OTA_GZ_DONE:
+      Ota_Fail(400, "Unexpected data after the gzip stream.");
+      return;
     }
+  }
+}
 
-    if (dataFile) // If file is open successfully
+// Body handler of POST /api/ota, runs for every part of the upload
+void Ota_Body(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (index == 0)
+  {
+    Ota_Begin(request, data, len, total);
+  }
+  if (_ota.request != request || _ota.failed)
+  {
+    return;
+  }
+  mbedtls_sha256_update(&_ota.sha, data, len);
+  _ota.received += len;
+  if (_ota.gzip)
+  {
+    // The trailer is the last 8 bytes, tinfl never sees it and is told when
+    // its input ends
+    size_t body = index < _ota.gzBodyEnd ? min(len, (size_t)(_ota.gzBodyEnd - index)) : 0;
+    if (body > 0)
+    {
+      Ota_Inflate(data, body, index + body == _ota.gzBodyEnd);
+    }
+    if (body < len)
     {
-      String logEntry = now.timestamp(DateTime::TIMESTAMP_FULL); // Full timestamp e.g., YYYY-MM-DDTHH:MM:SS
-      logEntry += ",";
-      logEntry += String(_count);
-      logEntry += ",";
-      logEntry += String(_runningAverageCPM, 2);
-      logEntry += ",";
-      logEntry += String(_runningAverageCPH, 2);
-      dataFile.println(logEntry);
-      dataFile.close();
+      memcpy(_ota.gzTrailer + (index + body - _ota.gzBodyEnd), data + body, len - body);
+    }
+  }
+  else
+  {
+    Ota_Flash(data, len);
+  }
+}
+
+// Request handler of POST /api/ota, runs once the whole body has been through Ota_Body()
+void Ota_Request(AsyncWebServerRequest *request)
+{
+  if (request->_tempObject != NULL)
+  {
+    request->send(409, "text/plain", (const char *)request->_tempObject);
+    return;
+  }
+  if (_ota.request != request)
+  {
+    request->send(400, "text/plain", "Bad Request: Empty upload");
+    return;
+  }
+
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&_ota.sha, digest);
+  uint32_t gzCrc, gzSize;
+  memcpy(&gzCrc, _ota.gzTrailer, sizeof(gzCrc));
+  memcpy(&gzSize, _ota.gzTrailer + 4, sizeof(gzSize));
+  if (_ota.gzip && _ota.gzState != OTA_GZ_DONE)
+  {
+    Ota_Fail(400, "Gzip stream is truncated.");
+  }
+  else if (_ota.gzip && (gzCrc != _ota.gzCrc || gzSize != _ota.written))
+  {
+    Ota_Fail(400, "Gzip checksum mismatch.");
+  }
+  else if (memcmp(digest, _ota.expected, sizeof(digest)) != 0)
+  {
+    Ota_Fail(400, "SHA-256 mismatch.");
+  }
+  else if (!_ota.failed && !Update.end(true))
+  {
+    Ota_Fail(500, Update.errorString());
+  }
+
+  if (_ota.failed)
+  {
+    int code = _ota.failCode;
+    Ota_Release();
+    request->send(code, "text/plain", "Update failed: " + _otaError);
+    return;
+  }
 
+  _otaState = "done";
+  if (!_ota.filesystem)
+  {
+    // The new image has OTA_MAX_TRIAL_BOOTS boots to reach Ota_Loop()'s confirmation
+    const esp_partition_t *slot = esp_ota_get_boot_partition();
+    Preferences ota;
+    ota.begin(OTA_PREFS_NAMESPACE);
+    ota.putString(OTA_KEY_SLOT, slot != NULL ? slot->label : "");
+    ota.putUChar(OTA_KEY_TRIAL, 1);
+    ota.putBool(OTA_KEY_ROLLED_BACK, false);
+    ota.end();
+    _otaRestartRequested = millis();
+    _otaRestart = true;
+  }
 #ifdef DEBUG
-      Serial.printf("Logged to %s: %s (%s)\n", filename.c_str(), logEntry.c_str(), newFile ? "New file" : "Appended");
+  Serial.printf("OTA: %s updated, %u bytes written\n", _otaTarget.c_str(), _ota.written);
 #endif
-      _lastLogTime = currentTime;
-      _lastLogCount = _count;
-    }
+  Ota_Release();
+  request->send(200, "text/plain", _ota.filesystem ? "OK" : "OK, restarting");
+}
+
+String Ota_StatusJson()
+{
+  JsonDocument doc;
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  const esp_partition_t *next = esp_ota_get_next_update_partition(NULL);
+#if ESP_IDF_VERSION_MAJOR >= 5
+  const esp_app_desc_t *app = esp_app_get_description();
+#else
+  const esp_app_desc_t *app = esp_ota_get_app_description();
+#endif
+  doc["running"] = running != NULL ? running->label : "";
+  doc["nextSlot"] = next != NULL ? next->label : "";
+  doc["version"] = app->version;
+  doc["built"] = String(app->date) + " " + app->time;
+  doc["state"] = _otaState;
+  doc["target"] = _otaTarget;
+  doc["received"] = _ota.received;
+  doc["written"] = _ota.written;
+  if (_otaError != "")
+  {
+    doc["error"] = _otaError;
   }
+  doc["pendingVerify"] = _otaPendingVerify;
+  doc["rolledBack"] = _otaRolledBack;
+
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
 }
@@ -4,6 +4,7 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <WiFi.h>
+#include <ESPmDNS.h>
 #include <DNSServer.h>
 #include <LittleFS.h>
 #include <ESPAsyncWebServer.h>
@@ -14,36 +15,149 @@
 #include <FS.h>
 #include <SD.h>
 #include <SPI.h>
+#include <mqtt_client.h>
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include <freertos/stream_buffer.h>
+#if __has_include(<esp32/rom/miniz.h>)
+#include <esp32/rom/miniz.h>
+#else
+#include <rom/miniz.h>
+#endif
 
 #define DEBUG
 
 #define EVENT_SOURCE_COUNT "/counterStream"
 #define EVENT_SOURCE_RUNNING_AVERAGE "/runningAverageStream"
 #define EVENT_SOURCE_TIME "/timeStream"
+#define EVENT_SOURCE_HISTORY "/historyStream" // "<minute start>,<count>,<total>" for each completed minute
+#define WEBSOCKET_TELEMETRY "/ws"
+
+// Binary telemetry frames, all fields little-endian
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_SNAPSHOT 0x01   // version u8, seq u16, count u32, cpm f32, cph f32, time u32, active u8, next u32
+#define TELEMETRY_DELTA 0x02      // seq u16, followed by records:
+#define TELEMETRY_REC_COUNT 0x10  //   increment u16
+#define TELEMETRY_REC_RATE 0x11   //   cpm f32, cph f32
+#define TELEMETRY_REC_TIME 0x12   //   time u32
+#define TELEMETRY_REC_SCHEDULE 0x13 // active u8, next u32
+#define TELEMETRY_MAX_CLIENTS 16
+
+// Counts per minute for the last day, kept in RTC memory, see History_Loop()
+#define HISTORY_MINUTES 1440
+#define HISTORY_MAGIC 0x48495332 // "HIS2", bumped whenever MinuteHistory changes
+#define HISTORY_MAX_SKEW 60      // Minutes the clock may go back before the ring is cleared
+#define HISTORY_MAX_MARKS 8      // Count resets and restores remembered, see History_Mark()
+
 #define DNS_PORT 53
 const IPAddress apIP(192, 168, 2, 1);
 const IPAddress gateway(255, 255, 255, 0);
 #define DEFAULT_AP_SSID "Drum Counter"
 #define DEFAULT_AP_PASSWORD ""
+#define DEFAULT_STA_SSID ""
+#define DEFAULT_STA_PASSWORD ""
+#define DEFAULT_HOSTNAME "drum-counter"
 
 #define SWITCH_PIN_1 25 // Limit switch 1 on GPIO 25
 #define SWITCH_PIN_2 26 // Limit switch 2 on GPIO 26
 #define PREFERENCES_KEY_NAME "count"
 #define ACTIVE_LOW_SWITCH true // Set to true for active-low inputs, false for active-high
 
-// Preference keys for schedule settings
+// All settings live in one versioned blob, see DeviceConfig
+#define PREF_KEY_CONFIG "config"
+#define CONFIG_VERSION 2
+#define CONFIG_MAX_BODY 4096 // Largest PATCH /api/config body accepted
+
+// Keys used before the config blob, only read to migrate old devices
+#define PREF_KEY_AP_SSID "ssid"
+#define PREF_KEY_AP_PASSWORD "password"
 #define PREF_KEY_SCH_ENABLED "schEnabled"
 #define PREF_KEY_SCH_START_H "schStartH"
 #define PREF_KEY_SCH_START_M "schStartM"
 #define PREF_KEY_SCH_STOP_H "schStopH"
 #define PREF_KEY_SCH_STOP_M "schStopM"
 
+// Preference keys for MQTT delivery state
+#define PREF_KEY_MQTT_SPOOL_POS "mqttSpoolPos"
+#define PREF_KEY_MQTT_SEQ "mqttSeq"
+
+#define DEFAULT_MQTT_TOPIC "barrel"
+#define MQTT_SPOOL_DIR "/mqtt"                 // Kept out of the way of the daily CSV logs
+#define MQTT_SPOOL_FILE "/mqtt/queue.jsonl"    // One batch message per line
+#define MQTT_SPOOL_MAX_BYTES (8UL * 1024 * 1024) // Newest batches are dropped beyond this
+#define MQTT_MAX_BATCH 30   // Samples per message
+#define MQTT_MAX_INFLIGHT 4 // Unacknowledged messages at once
+
+// SD worker, the only task that touches the card
+#define SD_QUEUE_DEPTH 16 // Jobs per priority queue
+#define SD_READ_CHUNK 2048 // Largest read a download gets per job
+#define SD_LIST_CHUNK 16   // Directory entries read per job
+#define SD_IO_BURST 4      // Web jobs in a row before a waiting background job gets a turn
+
+#define ARCHIVE_DIR "/archive"                      // Compressed closed days, <date>.csv.gz
+#define ARCHIVE_SUMMARY_FILE "/archive/summary.bin" // One DaySummary per archived day
+#define ARCHIVE_RETENTION_DAYS 730                  // Archives older than this are deleted
+#define ARCHIVE_MIN_FREE_BYTES (64ULL * 1024 * 1024) // Oldest archives go first below this
+#define ARCHIVE_CHUNK 1024                          // CSV bytes compressed per step
+#define DAY_SUMMARY_VERSION 1
+
+// Downsampled history for charts, see Series_Handler()
+#define SERIES_DEFAULT_POINTS 400
+#define SERIES_MIN_POINTS 40    // Four per bucket, so at least ten buckets
+#define SERIES_MAX_POINTS 2000  // Caps the reply at roughly 80 KB
+#define SERIES_MAX_QUERIES 2    // At once, each holds ~47 KB while reading an archived day
+#define SERIES_READS_PER_JOB 4  // SD_READ_CHUNK reads per worker job before others get a turn
+#define SERIES_STREAM_BYTES 2048 // Reply bytes scanned ahead of the client
+
+#define MAX_SHIFTS 8     // Shift slots in the weekly calendar
+#define MAX_HOLIDAYS 32  // Dates on which no shift starts
+#define ALL_WEEKDAYS 0x7F // Bit 0 = Sunday ... bit 6 = Saturday, same as DateTime::dayOfTheWeek()
+
+#define DEFAULT_LOG_INTERVAL 60 // Seconds between CSV rows
+#define DEFAULT_LOG_MAX_GAP 900 // Seconds, deadband mode
+#define DEFAULT_LOG_COUNT_BAND 1
+#define DEFAULT_LOG_RATE_BAND 0.5f // Counts per minute
+#define LOG_MAX_GAP_LIMIT 43200
+
+enum LogMode
+{
+  LOG_MODE_INTERVAL, // A row every log interval while the count changes
+  LOG_MODE_DEADBAND  // Sampled every log interval, a row only where interpolation would miss, see Log_Deadband()
+};
+
+// Over-the-air updates, state kept in its own NVS namespace so it is
+// readable before anything else starts
+#define OTA_PREFS_NAMESPACE "ota"
+#define OTA_KEY_TRIAL "trial"         // Boots of an unconfirmed image so far, 0 once confirmed
+#define OTA_KEY_SLOT "slot"           // App partition the last update went to
+#define OTA_KEY_ROLLED_BACK "rolledBack"
+#define OTA_MAX_TRIAL_BOOTS 3         // Boots a new image gets to confirm itself before rolling back
+#define OTA_SHA256_HEADER "X-Update-SHA256"
 
 const unsigned long saveInterval = 5000;
 const unsigned long debounceInterval = 500; // Milliseconds for switch debounce
 const long gmtOffset_sec = 7 * 3600;  // 7 hours in seconds
 const int daylightOffset_sec = 0;     // Jakarta doesn't observe DST
 
+// Station reconnect backoff, doubled after every failed attempt
+const unsigned long staRetryMinInterval = 2000;
+const unsigned long staRetryMaxInterval = 60000;
+const unsigned long staConnectTimeout = 15000; // Give up on an attempt that never reports back
+
+const unsigned long mqttDrainInterval = 250; // At most one spooled batch per 250 ms after reconnecting
+const unsigned long mqttAckTimeout = 30000;   // Unacknowledged batches go back to the spool after this
+
+const unsigned long telemetryInterval = 100; // Coalesce deltas into one frame per 100 ms
+
+const unsigned long archiveStepInterval = 10; // Archive job does one chunk of work at most this often
+const unsigned long sdRunTimeout = 500;       // Longest the web server waits for an SD job to start
+
+const unsigned long clockSyncInterval = 60000; // Discipline the software clock against the RTC once a minute
+
+const unsigned long otaConfirmDelay = 60000; // A new image that runs this long is kept
+const unsigned long otaRestartDelay = 1000;  // Lets the upload response go out before restarting
+
 const double ALPHA_CPM = 1.0 / 60.0;
 const double ALPHA_CPH = 1.0 / 3600.0;
 
@@ -52,18 +166,52 @@ extern AsyncWebServer server;
 extern AsyncEventSource countEvents;
 extern AsyncEventSource runningAverageEvents;
 extern AsyncEventSource timeEvents;
+extern AsyncEventSource historyEvents;
+extern AsyncWebSocket telemetrySocket;
 extern LiquidCrystal_I2C LCD;
 extern Preferences preferences;
 extern RTC_DS3231 rtc;
 
-extern String STA_SSID;
-extern String STA_PASSWORD;
-extern String AP_SSID;
-extern String AP_PASSWORD;
-extern int Log_Interval;
+enum StaState
+{
+  STA_IDLE,         // No credentials configured
+  STA_CONNECTING,   // WiFi.begin() issued, waiting for an event
+  STA_CONNECTED,    // Got an IP on the plant LAN
+  STA_WAITING_RETRY // Disconnected, next attempt scheduled
+};
+extern volatile StaState _staState;
+extern volatile uint8_t _staLastReason;
+extern uint _staAttempts;
+extern ulong _staAttemptTime;
+extern ulong _staRetryDelay;
 extern ulong _lastLogTime;
 extern uint _lastLogCount;
 
+// Fixed-size record appended to ARCHIVE_SUMMARY_FILE for every archived day
+struct DaySummary
+{
+  uint16_t version;
+  uint16_t rows;        // Logged rows in the day file
+  uint32_t day;         // Days since 1970-01-01
+  uint32_t firstTime;   // Time of the first and last row
+  uint32_t lastTime;
+  uint32_t finalCount;  // Count in the last row
+  float maxCpm;
+  float maxCph;
+  uint32_t rawBytes;    // Size of the CSV and of its archive
+  uint32_t gzipBytes;
+};
+static_assert(sizeof(DaySummary) == 36, "DaySummary is a fixed-size on-card record");
+
+enum SdPriority
+{
+  SD_PRIO_LOG,        // Log and spool appends, always served first
+  SD_PRIO_IO,         // Web downloads, listings and deletes
+  SD_PRIO_BACKGROUND, // Archiving and MQTT spool reads
+  SD_PRIO_COUNT
+};
+typedef void (*SdJobFn)(void *context);
+
 extern volatile uint _count;
 extern ulong _lastSaveTime;
 
@@ -77,6 +225,12 @@ extern unsigned long lastDebounceTimePin2;
 
 extern DateTime _currentDate;
 extern DateTime _lastDate;
+extern uint32_t _currentUnix;
+
+// Software clock, advanced from millis() and re-based on the RTC
+extern uint32_t _clockBaseUnix;
+extern ulong _clockBaseMillis;
+extern ulong _lastClockSync;
 
 extern ulong _lastTimeCheck;
 extern uint _lastCountCheck;
@@ -84,38 +238,149 @@ extern double _runningAverageCPM;
 extern double _runningAverageCPH;
 
 // Schedule variables
-extern bool scheduleEnabled; 
-extern int startHour;      
-extern int startMinute;    
-extern int stopHour;       
-extern int stopMinute;     
+struct Shift
+{
+  uint8_t days;   // Weekday bitmask, see ALL_WEEKDAYS
+  uint16_t start; // Minutes after midnight
+  uint16_t stop;  // Minutes after midnight, before start means the shift runs past midnight
+};
+
+// Every persisted setting. Stored as the bytes up to crc followed by the
+// CRC-32 of those bytes. New fields are only ever appended before crc, and
+// CONFIG_VERSION is bumped with a matching case in Config_Migrate().
+struct DeviceConfig
+{
+  uint16_t version;
+  uint16_t size; // Bytes before crc when written
+
+  // Network
+  char apSsid[33];
+  char apPassword[64];
+  char staSsid[33];
+  char staPassword[64];
+
+  // Logging
+  uint16_t logInterval; // Seconds between CSV rows
+
+  // Schedule
+  bool scheduleEnabled;
+  uint8_t shiftCount;
+  uint8_t holidayCount;
+  Shift shifts[MAX_SHIFTS];
+  uint16_t holidays[MAX_HOLIDAYS]; // Days since 1970-01-01
+
+  // MQTT
+  bool mqttEnabled;
+  uint8_t mqttQos;
+  uint8_t mqttBatch;     // Samples per published message
+  uint16_t mqttInterval; // Seconds between samples
+  char mqttUri[128];
+  char mqttUsername[64];
+  char mqttPassword[64];
+  char mqttTopic[64];
+
+  // Logging, version 2
+  uint8_t logMode;       // LogMode
+  uint16_t logMaxGap;    // Seconds, deadband mode writes a changed value at least this often
+  uint16_t logCountBand; // Counts the interpolated count may be off by
+  float logRateBand;     // Counts per minute the interpolated cpm may be off by, cph gets 60 times this
+
+  uint32_t crc;
+};
+
+extern DeviceConfig config;
+extern bool _scheduleActive;
+extern uint32_t _scheduleNextTransition;
 
 void redirectToIndex(AsyncWebServerRequest *request);
 void WiFi_Init();
 void WiFi_Connect();
+void WiFi_Loop();
+void WiFi_Event(WiFiEvent_t event, WiFiEventInfo_t info);
+void WiFi_Reconnect();
+String WiFi_StatusJson();
 
 void Webserver_Init();
 void Webserver_Routes();
 void Webserver_Loop();
 void Send_Event(AsyncEventSource& eventSource, const String &eventData);
 
+void Telemetry_Event(AsyncWebSocket *socket, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
+void Telemetry_Loop();
+
+void History_Init();
+void History_Count();
+void History_Mark(uint32_t before);
+void History_Loop();
+void History_Handler(AsyncWebServerRequest *request);
+
 void LCD_Init();
 void Preferences_Init();
+
+void Config_Defaults(DeviceConfig &cfg);
+void Config_Load();
+void Config_Save();
+uint32_t Config_Crc(const DeviceConfig &cfg);
+String Config_ETag(const DeviceConfig &cfg);
+String Config_ToJson(const DeviceConfig &cfg);
+void Config_Snapshot(DeviceConfig &cfg);
+bool Config_Patch(JsonVariantConst doc, String &error);
+void Config_Loop();
+void Config_Handler(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total);
 void Save_To_Preferences(ulong interval);
 
 void RTC_Init();
 DateTime RTC_getTime();
 
+void Clock_Sync(bool force);
+uint32_t Clock_Now();
+
 void SD_Init();
-String listDir(fs::FS &fs, const char * dirname, uint8_t levels);
+void SD_Worker_Init();
+bool SD_Submit(SdPriority priority, SdJobFn fn, void *context);
+bool SD_Run(SdPriority priority, SdJobFn fn, void *context, TickType_t wait = pdMS_TO_TICKS(sdRunTimeout));
+bool SD_Append(const String &path, const String &data);
+bool SD_Remove(const String &path);
+bool SD_RemoveNow(const String &path, bool &busy);
+String SD_StatusJson();
+String listDir(fs::FS &fs, const char * dirname, uint8_t levels, bool *busy = NULL);
 
 void Log_SD(ulong interval);
+void Log_Flush();
+void Log_Restart();
+void Data_Handler(AsyncWebServerRequest *request);
+void Series_Handler(AsyncWebServerRequest *request);
+
+void Archive_Request();
+void Archive_Loop();
+
+void Mqtt_Init();
+void Mqtt_Start();
+void Mqtt_Stop();
+void Mqtt_Loop();
+String Mqtt_StatusJson();
+void Mqtt_Restart();
+void Mqtt_SettingsToJson(JsonObject doc, const DeviceConfig &cfg);
+bool Mqtt_SettingsFromJson(JsonVariantConst doc, DeviceConfig &cfg, String &error);
+void Mqtt_SaveState();
+
+void Ota_Init();
+void Ota_Loop();
+void Ota_Body(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total);
+void Ota_Request(AsyncWebServerRequest *request);
+String Ota_StatusJson();
 
 void Read_Switches(ulong debounceInterval, bool isActiveLow);
 void Update_Running_Averages();
 void Reset_Count();
 
+void Schedule_Invalidate();
+bool Schedule_ActiveAt(uint32_t t);
+void Schedule_Compile(uint32_t now);
+void Schedule_ToJson(JsonObject doc, const DeviceConfig &cfg);
+bool Schedule_FromJson(JsonVariantConst doc, DeviceConfig &cfg, String &error);
+
 // Function to check if current time is within scheduled counting range
-bool isTimeWithinScheduledRange(const DateTime& now);
+bool isTimeWithinScheduledRange(uint32_t now);
 
 #endif
\ No newline at end of file
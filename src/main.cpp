@@ -7,6 +7,8 @@
 
 void setup() {
   Serial.begin(115200);
+  // Before anything that could crash, so a bad update is rolled back
+  Ota_Init();
   
   if (ACTIVE_LOW_SWITCH) { 
     pinMode(SWITCH_PIN_1, INPUT_PULLUP); 
@@ -25,9 +27,16 @@ void setup() {
   RTC_Init();
   LCD_Init();
   SD_Init();
-  _currentDate = RTC_getTime();
+  Clock_Sync(true);
+  _currentUnix = Clock_Now();
+  _currentDate = DateTime(_currentUnix);
+  // Needs the clock, before the first count
+  History_Init();
   Preferences_Init(); 
   Webserver_Init();
+  Mqtt_Init();
+  // Pick up days that closed while the counter was off
+  Archive_Request();
 
   if (_lastTimeCheck == 0) {
       _lastTimeCheck = millis();
@@ -37,18 +46,20 @@ void setup() {
 
 void loop() {
   Webserver_Loop();
+  // Settings patched from the web take effect here
+  Config_Loop();
   
   Read_Switches(debounceInterval, ACTIVE_LOW_SWITCH); 
 
   Update_Running_Averages();
 
   String formattedTime;
-  static unsigned long lastTimeUpdate = 0;
-  unsigned long nowMillis = millis();
+  Clock_Sync(false);
+  uint32_t nowUnix = Clock_Now();
 
-  if (nowMillis - lastTimeUpdate >= 1000) {
-    lastTimeUpdate = nowMillis;
-    _currentDate = RTC_getTime();
+  if (nowUnix != _currentUnix) {
+    _currentUnix = nowUnix;
+    _currentDate = DateTime(_currentUnix);
     char buf2[] = "DD-MM-YY hh:mm";
     char buf1[] = "YYYY-MM-DDThh:mm:ss"; 
     formattedTime = _currentDate.toString(buf2);
@@ -56,8 +67,11 @@ void loop() {
     Send_Event(timeEvents, formattedTimeISO);
 
     if (_currentDate.day() != _lastDate.day()) {
+      // The deadband may still hold a row of the day that just closed
+      Log_Flush();
       Reset_Count();
       _lastDate = _currentDate;
+      Archive_Request();
 #ifdef DEBUG
       Serial.println("New day detected. Count and averages reset.");
 #endif
@@ -78,6 +92,14 @@ void loop() {
 
   // Save the _count and running averages to the preferences every saveInterval
   Save_To_Preferences(saveInterval); // Use saveInterval from config.h
+  // Roll the minute history over, pushing each completed minute
+  History_Loop();
   // Log data to SD card periodically
-  Log_SD(Log_Interval * 1000); // Use Log_Interval from config.h
+  Log_SD(config.logInterval * 1000UL);
+  // Compress closed days in the background, one chunk at a time
+  Archive_Loop();
+  // Batch counts for MQTT, spool them to SD while the broker is unreachable
+  Mqtt_Loop();
+  // Confirm a freshly updated image, restart into one that was just uploaded
+  Ota_Loop();
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+/**
+ * Client for the device's in-RAM minute history (`/api/history`) and its
+ * push of each completed minute (`/historyStream`). Neither touches the SD card.
+ */
+export interface MinuteHistory {
+  start: number; // device local time of the oldest minute, seconds since 1970
+  step: number; // seconds per entry
+  count: number; // count when the reply was built
+  counts: number[]; // per minute, oldest first, the last one still running
+  totals: number[]; // count at the end of each minute, resets included
+}
+
+export function fetchHistory(): Promise<MinuteHistory> {
+  return fetch("/api/history").then((response) => {
+    if (!response.ok) {
+      throw new Error(`Failed to fetch history: ${response.statusText}`);
+    }
+    return response.json();
+  });
+}
+
+/**
+ * Turns the device's current day so far into chart series named like the CSV
+ * columns: the count, counts per minute and counts over the trailing hour.
+ * The day is taken from the device's clock, the newest minute, so a page left
+ * open past midnight moves on with it. Times are in milliseconds.
+ * Returns null if the history does not reach back to midnight.
+ */
+export function historySeries(history: MinuteHistory) {
+  const last = history.start + (history.counts.length - 1) * history.step;
+  const dayStart = last - (last % 86400);
+  const date = new Date(dayStart * 1000).toISOString().slice(0, 10);
+  if (history.start > dayStart) {
+    return null;
+  }
+  const first = Math.round((dayStart - history.start) / history.step);
+  const count: number[][] = [];
+  const cpm: number[][] = [];
+  const cph: number[][] = [];
+  let hour = 0;
+  for (let i = first; i < history.counts.length; i++) {
+    const time = (history.start + i * history.step) * 1000;
+    hour += history.counts[i] - (i >= first + 60 ? history.counts[i - 60] : 0);
+    count.push([time, history.totals[i]]);
+    cpm.push([time, history.counts[i]]);
+    cph.push([time, hour]);
+  }
+  return {
+    date,
+    series: [
+      { name: "count " + date, data: count },
+      { name: "cpm " + date, data: cpm },
+      { name: "cph " + date, data: cph },
+    ],
+  };
+}
+
+/**
+ * Adds a minute pushed by `/historyStream` to `history`, or closes the running
+ * one. Returns false if it does not follow on, e.g. the page was asleep or
+ * the device restarted, and the history should be fetched again.
+ */
+export function appendMinute(history: MinuteHistory, time: number, count: number, total: number): boolean {
+  const last = history.counts.length - 1;
+  const lastTime = history.start + last * history.step;
+  if (time === lastTime) {
+    history.counts[last] = count;
+    history.totals[last] = total;
+  } else if (time === lastTime + history.step) {
+    history.counts.push(count);
+    history.totals.push(total);
+    if (history.counts.length > 1440) {
+      history.counts.shift();
+      history.totals.shift();
+      history.start += history.step;
+    }
+  } else {
+    return false;
+  }
+  history.count = total;
+  return true;
+}
+
+/**
+ * Calls `onMinute` with the start time (seconds), count and closing total of
+ * every minute the device completes. Returns a function that stops listening.
+ */
+export function subscribeMinutes(onMinute: (time: number, count: number, total: number) => void): () => void {
+  const source = new EventSource("/historyStream");
+  source.onmessage = (event) => {
+    const [time, count, total] = String(event.data).split(",").map(Number);
+    onMinute(time, count, total);
+  };
+  return () => source.close();
+}
@@ -0,0 +1,103 @@
+/**
+ * Client for the binary telemetry WebSocket (`/ws`).
+ * The device sends one snapshot when a client connects (or falls behind),
+ * then delta frames carrying only what changed. All fields are little-endian.
+ */
+export interface TelemetryState {
+  count: number;
+  cpm: number;
+  cph: number;
+  time: number; // device local time, seconds since 1970
+  scheduleActive: boolean;
+  nextTransition: number;
+}
+
+const SNAPSHOT = 0x01;
+const DELTA = 0x02;
+const REC_COUNT = 0x10;
+const REC_RATE = 0x11;
+const REC_TIME = 0x12;
+const REC_SCHEDULE = 0x13;
+
+/**
+ * Opens the telemetry socket and calls `onState` after every applied frame.
+ * Reconnects after a drop. Returns a function that closes the connection.
+ */
+export function connectTelemetry(onState: (state: TelemetryState) => void): () => void {
+  const state: TelemetryState = {
+    count: 0,
+    cpm: 0,
+    cph: 0,
+    time: 0,
+    scheduleActive: true,
+    nextTransition: 0,
+  };
+  let seq = -1;
+  let socket: WebSocket;
+  let closed = false;
+
+  function open() {
+    socket = new WebSocket(`ws://${location.host}/ws`);
+    socket.binaryType = "arraybuffer";
+    socket.onmessage = (event) => {
+      const view = new DataView(event.data as ArrayBuffer);
+      const type = view.getUint8(0);
+      if (type === SNAPSHOT) {
+        seq = view.getUint16(2, true);
+        state.count = view.getUint32(4, true);
+        state.cpm = view.getFloat32(8, true);
+        state.cph = view.getFloat32(12, true);
+        state.time = view.getUint32(16, true);
+        state.scheduleActive = view.getUint8(20) !== 0;
+        state.nextTransition = view.getUint32(21, true);
+      } else if (type === DELTA) {
+        const frameSeq = view.getUint16(1, true);
+        if (seq < 0 || frameSeq !== ((seq + 1) & 0xffff)) {
+          // Missed a frame, a snapshot will follow
+          return;
+        }
+        seq = frameSeq;
+        let offset = 3;
+        while (offset < view.byteLength) {
+          const record = view.getUint8(offset++);
+          if (record === REC_COUNT) {
+            state.count += view.getUint16(offset, true);
+            offset += 2;
+          } else if (record === REC_RATE) {
+            state.cpm = view.getFloat32(offset, true);
+            state.cph = view.getFloat32(offset + 4, true);
+            offset += 8;
+          } else if (record === REC_TIME) {
+            state.time = view.getUint32(offset, true);
+            offset += 4;
+          } else if (record === REC_SCHEDULE) {
+            state.scheduleActive = view.getUint8(offset) !== 0;
+            state.nextTransition = view.getUint32(offset + 1, true);
+            offset += 5;
+          } else {
+            console.error("Unknown telemetry record:", record);
+            break;
+          }
+        }
+      } else {
+        return;
+      }
+      onState({ ...state });
+    };
+    socket.onclose = () => {
+      seq = -1;
+      if (!closed) {
+        setTimeout(open, 2000);
+      }
+    };
+    socket.onerror = (error) => {
+      console.error("Telemetry socket failed:", error);
+    };
+  }
+
+  open();
+  return () => {
+    closed = true;
+    socket.close();
+  };
+}